@@ -0,0 +1,561 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+
+Benchmarks for the qop library and qopconv
+
+Generates a synthetic directory tree, packs it with qopconv and measures
+opening, lookup and reading through qop.h as well as qopconv pack and unpack
+speed. Results are printed as one tab separated line per measurement:
+
+name <TAB> value <TAB> unit
+
+Lines starting with # are comments that describe the run.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define QOP_IMPLEMENTATION
+#include "qop.h"
+
+#define UNUSED(x) (void)(x)
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+#define die(...) \
+	printf("Abort at " TOSTRING(__FILE__) " line " TOSTRING(__LINE__) ": " __VA_ARGS__); \
+	printf("\n"); \
+	exit(1)
+
+#define error_if(TEST, ...) \
+	if (TEST) { \
+		die(__VA_ARGS__); \
+	}
+
+#define MAX_PATH_LEN 1024
+#define READ_EX_LEN 4096
+#define READ_STREAM_LEN (64 * 1024)
+#define BENCH_ROOT "bench"
+
+
+// -----------------------------------------------------------------------------
+// Helpers
+
+typedef struct {
+	int files;
+	unsigned int min_size;
+	unsigned int max_size;
+	int min_path_len;
+	int max_path_len;
+	int runs;
+	const char *qopconv;
+	const char *pack_flags;
+	const char *work_dir;
+} bench_options;
+
+static qop_uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static unsigned int rng(void) {
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void result(const char *name, double value, const char *unit) {
+	printf("%s\t%.3f\t%s\n", name, value, unit);
+	fflush(stdout);
+}
+
+static void run(const char *cmd) {
+	error_if(system(cmd) != 0, "Command failed: %s", cmd);
+}
+
+// Evict the file from the page cache, so that the next read hits the disk.
+// Returns 0 if this is not supported.
+static int evict_file(const char *path) {
+	#if defined(POSIX_FADV_DONTNEED)
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return 0;
+		}
+		fdatasync(fd);
+		int ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+		close(fd);
+		return ok;
+	#else
+		UNUSED(path);
+		return 0;
+	#endif
+}
+
+
+// -----------------------------------------------------------------------------
+// Synthetic data
+
+static const char *words[] = {
+	"assets", "textures", "models", "characters", "environment", "shaders",
+	"ui", "audio", "music", "levels", "common", "fonts", "sprites", "data",
+	"maps", "effects", "particles", "weapons", "vehicles", "props"
+};
+#define WORDS_LEN (int)(sizeof(words) / sizeof(words[0]))
+
+// Build a unique path of the given length from random directory names, ending
+// in a numbered file name.
+static void make_path(char *dest, int len, int index) {
+	char name[32];
+	int name_len = snprintf(name, sizeof(name), "f%06d.bin", index);
+	int pos = 0;
+	while (pos + name_len < len) {
+		const char *w = words[rng() % WORDS_LEN];
+		int w_len = strlen(w);
+		if (pos + w_len + 1 + name_len > len) {
+			// Fill the rest with a single directory of the remaining length
+			w_len = len - name_len - pos - 1;
+			if (w_len <= 0) {
+				break;
+			}
+			memset(dest + pos, 'x', w_len);
+		}
+		else {
+			memcpy(dest + pos, w, w_len);
+		}
+		pos += w_len;
+		dest[pos++] = '/';
+	}
+	memcpy(dest + pos, name, name_len + 1);
+}
+
+// Sizes are distributed roughly log-uniformly between min and max, so that
+// there are many small and few large files.
+static unsigned int make_size(const bench_options *o) {
+	unsigned int min = o->min_size ? o->min_size : 1;
+	if (o->max_size <= min) {
+		return o->max_size;
+	}
+	int doublings = 0;
+	while (((qop_uint64_t)min << (doublings + 1)) <= o->max_size) {
+		doublings++;
+	}
+	qop_uint64_t base = (qop_uint64_t)min << (rng() % (doublings + 1));
+	qop_uint64_t size = base + rng() % base;
+	return size > o->max_size ? o->max_size : size;
+}
+
+// File contents are words separated by spaces and random numbers, so that
+// compression has something to do, but does not shrink everything to nothing.
+static void make_contents(unsigned char *dest, unsigned int size) {
+	unsigned int pos = 0;
+	while (pos < size) {
+		char token[32];
+		int len = (rng() & 3) == 0
+			? snprintf(token, sizeof(token), "%u ", rng())
+			: snprintf(token, sizeof(token), "%s ", words[rng() % WORDS_LEN]);
+		if (pos + len > size) {
+			len = size - pos;
+		}
+		memcpy(dest + pos, token, len);
+		pos += len;
+	}
+}
+
+static void create_parent_dirs(char *path) {
+	for (char *p = path + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(path, 0755);
+			*p = '/';
+		}
+	}
+}
+
+// Write the synthetic tree to dir and return the paths of all files, relative
+// to dir.
+static char **generate_tree(const bench_options *o, const char *dir, qop_uint64_t *total_size) {
+	char **paths = malloc(o->files * sizeof(char *));
+	unsigned char *contents = malloc(o->max_size ? o->max_size : 1);
+	*total_size = 0;
+
+	for (int i = 0; i < o->files; i++) {
+		int len = o->min_path_len;
+		if (o->max_path_len > o->min_path_len) {
+			len += rng() % (o->max_path_len - o->min_path_len + 1);
+		}
+		// All files are in one top level dir, so that qopconv can pack them
+		// without a "./" prefix
+		paths[i] = malloc(len + 32);
+		memcpy(paths[i], BENCH_ROOT "/", sizeof(BENCH_ROOT));
+		make_path(paths[i] + sizeof(BENCH_ROOT), len - sizeof(BENCH_ROOT), i);
+
+		char full[MAX_PATH_LEN * 2];
+		snprintf(full, sizeof(full), "%s/%s", dir, paths[i]);
+		create_parent_dirs(full);
+
+		unsigned int size = make_size(o);
+		make_contents(contents, size);
+		FILE *fh = fopen(full, "wb");
+		error_if(!fh, "Could not open %s for writing", full);
+		error_if(size && fwrite(contents, size, 1, fh) != 1, "Could not write %s", full);
+		fclose(fh);
+		*total_size += size;
+	}
+	free(contents);
+	return paths;
+}
+
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+
+static void bench_pack(const bench_options *o, const char *tree_dir, const char *archive_path, qop_uint64_t total_size) {
+	char cmd[MAX_PATH_LEN * 3];
+	snprintf(cmd, sizeof(cmd), "%s %s -d %s " BENCH_ROOT " %s > /dev/null", o->qopconv, o->pack_flags, tree_dir, archive_path);
+
+	double best = 0;
+	for (int r = 0; r < o->runs; r++) {
+		remove(archive_path);
+		double start = now();
+		run(cmd);
+		double t = now() - start;
+		best = r == 0 || t < best ? t : best;
+	}
+	result("pack", total_size / best / (1024 * 1024), "MB/s");
+}
+
+static void bench_unpack(const bench_options *o, const char *unpack_dir, const char *archive_path, qop_uint64_t total_size) {
+	char cmd[MAX_PATH_LEN * 3];
+	snprintf(cmd, sizeof(cmd), "cd %s && %s -u %s > /dev/null", unpack_dir, o->qopconv, archive_path);
+
+	double best = 0;
+	for (int r = 0; r < o->runs; r++) {
+		double start = now();
+		run(cmd);
+		double t = now() - start;
+		best = r == 0 || t < best ? t : best;
+	}
+	result("unpack", total_size / best / (1024 * 1024), "MB/s");
+}
+
+typedef unsigned long long (*open_func)(const char *path, qop_desc *qop);
+
+static void bench_open(const char *name, open_func open_archive, const char *archive_path, int runs) {
+	int iterations = runs * 100;
+	double start = now();
+	for (int i = 0; i < iterations; i++) {
+		qop_desc qop;
+		error_if(!open_archive(archive_path, &qop), "Could not open %s", archive_path);
+		void *buffer = malloc(qop.hashmap_size);
+		error_if(!qop_read_index(&qop, buffer), "Could not read index of %s", archive_path);
+		qop_close(&qop);
+		free(buffer);
+	}
+	result(name, (now() - start) / iterations * 1e6, "us");
+}
+
+static void bench_find(qop_desc *qop, char **paths, int paths_len, int runs) {
+	// Misses differ from existing paths only in their last character, so that
+	// they have the same length and prefix as hits
+	char **misses = malloc(paths_len * sizeof(char *));
+	for (int i = 0; i < paths_len; i++) {
+		misses[i] = strdup(paths[i]);
+		misses[i][strlen(misses[i]) - 1] = '_';
+	}
+
+	int iterations = runs * 20;
+	int found = 0;
+	double start = now();
+	for (int r = 0; r < iterations; r++) {
+		for (int i = 0; i < paths_len; i++) {
+			found += qop_find(qop, paths[i]) != NULL;
+		}
+	}
+	error_if(found != paths_len * iterations, "Not all paths were found");
+	result("find_hit", (double)paths_len * iterations / (now() - start) / 1e6, "M/s");
+
+	start = now();
+	for (int r = 0; r < iterations; r++) {
+		for (int i = 0; i < paths_len; i++) {
+			found += qop_find(qop, misses[i]) != NULL;
+		}
+	}
+	error_if(found != paths_len * iterations, "Found a path that does not exist");
+	result("find_miss", (double)paths_len * iterations / (now() - start) / 1e6, "M/s");
+
+	for (int i = 0; i < paths_len; i++) {
+		free(misses[i]);
+	}
+	free(misses);
+}
+
+static double read_all(qop_desc *qop, unsigned char *buffer) {
+	double start = now();
+	for (unsigned int i = 0; i < qop->hashmap_len; i++) {
+		qop_file *file = &qop->hashmap[i];
+		if (file->size) {
+			error_if(qop_read(qop, file, buffer) != file->size, "Could not read file %u", i);
+		}
+	}
+	return now() - start;
+}
+
+static void bench_read(qop_desc *qop, const char *archive_path, qop_uint64_t total_size, unsigned int max_size, int runs) {
+	unsigned char *buffer = malloc(max_size ? max_size : 1);
+
+	if (evict_file(archive_path)) {
+		result("read_cold", total_size / read_all(qop, buffer) / (1024 * 1024), "MB/s");
+	}
+	else {
+		printf("# read_cold skipped: can not evict the archive from the page cache\n");
+	}
+
+	double best = 0;
+	for (int r = 0; r < runs; r++) {
+		double t = read_all(qop, buffer);
+		best = r == 0 || t < best ? t : best;
+	}
+	result("read_warm", total_size / best / (1024 * 1024), "MB/s");
+
+	// Read READ_EX_LEN bytes at random offsets of random files
+	qop_file **files = malloc(qop->index_len * sizeof(qop_file *));
+	int files_len = 0;
+	for (unsigned int i = 0; i < qop->hashmap_len; i++) {
+		if (qop->hashmap[i].size) {
+			files[files_len++] = &qop->hashmap[i];
+		}
+	}
+
+	int iterations = runs * 10000;
+	qop_uint64_t bytes = 0;
+	double start = now();
+	for (int i = 0; i < iterations; i++) {
+		qop_file *file = files[rng() % files_len];
+		qop_uint64_t offset = rng() % file->size;
+		bytes += qop_read_ex(qop, file, buffer, offset, READ_EX_LEN);
+	}
+	double t = now() - start;
+	result("read_ex", iterations / t / 1e3, "K/s");
+	result("read_ex_bytes", bytes / t / (1024 * 1024), "MB/s");
+
+	free(files);
+	free(buffer);
+}
+
+// Stream every file through a small buffer, like a parser would
+static double read_stream_all(qop_desc *qop, unsigned char *buffer) {
+	double start = now();
+	for (unsigned int i = 0; i < qop->hashmap_len; i++) {
+		qop_file *file = &qop->hashmap[i];
+		if (file->size == 0) {
+			continue;
+		}
+		qop_stream stream;
+		error_if(!qop_stream_open(qop, file, &stream), "Could not open stream for file %u", i);
+		qop_uint64_t bytes_read = 0;
+		qop_uint64_t n;
+		while ((n = qop_stream_read(&stream, buffer, READ_STREAM_LEN)) > 0) {
+			bytes_read += n;
+		}
+		error_if(bytes_read != file->size, "Could not stream file %u", i);
+		qop_stream_close(&stream);
+	}
+	return now() - start;
+}
+
+static void bench_read_stream(qop_desc *qop, const char *archive_path, qop_uint64_t total_size, int runs) {
+	unsigned char *buffer = malloc(READ_STREAM_LEN);
+
+	if (evict_file(archive_path)) {
+		result("read_stream_cold", total_size / read_stream_all(qop, buffer) / (1024 * 1024), "MB/s");
+	}
+	else {
+		printf("# read_stream_cold skipped: can not evict the archive from the page cache\n");
+	}
+
+	double best = 0;
+	for (int r = 0; r < runs; r++) {
+		double t = read_stream_all(qop, buffer);
+		best = r == 0 || t < best ? t : best;
+	}
+	result("read_stream_warm", total_size / best / (1024 * 1024), "MB/s");
+	free(buffer);
+}
+
+static double read_batch(qop_desc *qop, qop_read_request *requests, unsigned int len) {
+	double start = now();
+	error_if(qop_read_batch(qop, requests, len, NULL) != len, "Could not read all files in a batch");
+	return now() - start;
+}
+
+static void bench_read_batch(qop_desc *qop, const char *archive_path, qop_uint64_t total_size, int runs) {
+	// All files at once, each into its own buffer
+	qop_read_request *requests = malloc(qop->index_len * sizeof(qop_read_request));
+	unsigned char *buffer = malloc(total_size ? total_size : 1);
+	unsigned int len = 0;
+	qop_uint64_t offset = 0;
+	for (unsigned int i = 0; i < qop->hashmap_len; i++) {
+		if (qop->hashmap[i].size) {
+			requests[len].file = &qop->hashmap[i];
+			requests[len].dest = buffer + offset;
+			offset += qop->hashmap[i].size;
+			len++;
+		}
+	}
+
+	if (evict_file(archive_path)) {
+		result("read_batch_cold", total_size / read_batch(qop, requests, len) / (1024 * 1024), "MB/s");
+	}
+	else {
+		printf("# read_batch_cold skipped: can not evict the archive from the page cache\n");
+	}
+
+	double best = 0;
+	for (int r = 0; r < runs; r++) {
+		double t = read_batch(qop, requests, len);
+		best = r == 0 || t < best ? t : best;
+	}
+	result("read_batch_warm", total_size / best / (1024 * 1024), "MB/s");
+
+	free(buffer);
+	free(requests);
+}
+
+
+// -----------------------------------------------------------------------------
+// Main
+
+static void exit_usage(void) {
+	puts(
+		"Usage: qopbench [OPTION...]\n"
+		"\n"
+		"Options:\n"
+		"  -n <files> ........ number of files (default 2000)\n"
+		"  -s <min>:<max> .... file sizes in bytes (default 512:262144)\n"
+		"  -p <min>:<max> .... path lengths (default 40:120)\n"
+		"  -r <runs> ......... number of runs per measurement (default 3)\n"
+		"  -q <qopconv> ...... qopconv executable (default ./qopconv)\n"
+		"  -f <flags> ........ flags for qopconv when packing (default --hashmap)\n"
+		"  -w <dir> .......... directory for the generated files (default /tmp)\n"
+	);
+	exit(1);
+}
+
+static void parse_range(const char *arg, unsigned int *min, unsigned int *max) {
+	error_if(sscanf(arg, "%u:%u", min, max) != 2 || *min > *max, "Invalid range %s", arg);
+}
+
+int main(int argc, char **argv) {
+	bench_options o = {
+		.files = 2000,
+		.min_size = 512,
+		.max_size = 256 * 1024,
+		.min_path_len = 40,
+		.max_path_len = 120,
+		.runs = 3,
+		.qopconv = "./qopconv",
+		.pack_flags = "--hashmap",
+		.work_dir = "/tmp"
+	};
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			exit_usage();
+		}
+		if (strcmp(argv[i], "-n") == 0) {
+			o.files = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			parse_range(argv[++i], &o.min_size, &o.max_size);
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			unsigned int min, max;
+			parse_range(argv[++i], &min, &max);
+			o.min_path_len = min;
+			o.max_path_len = max;
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			o.runs = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-q") == 0) {
+			o.qopconv = argv[++i];
+		}
+		else if (strcmp(argv[i], "-f") == 0) {
+			o.pack_flags = argv[++i];
+		}
+		else if (strcmp(argv[i], "-w") == 0) {
+			o.work_dir = argv[++i];
+		}
+		else {
+			exit_usage();
+		}
+	}
+	error_if(o.files < 1 || o.runs < 1, "Need at least one file and one run");
+	error_if(o.min_path_len < 16 || o.max_path_len > MAX_PATH_LEN - 32, "Path lengths must be in 16..%d", MAX_PATH_LEN - 32);
+
+	char base_dir[MAX_PATH_LEN / 2];
+	snprintf(base_dir, sizeof(base_dir), "%s/qopbench-XXXXXX", o.work_dir);
+	error_if(!mkdtemp(base_dir), "Could not create a directory in %s", o.work_dir);
+
+	char tree_dir[MAX_PATH_LEN], unpack_dir[MAX_PATH_LEN], archive_path[MAX_PATH_LEN];
+	snprintf(tree_dir, sizeof(tree_dir), "%s/tree", base_dir);
+	snprintf(unpack_dir, sizeof(unpack_dir), "%s/unpack", base_dir);
+	snprintf(archive_path, sizeof(archive_path), "%s/bench.qop", base_dir);
+	mkdir(tree_dir, 0755);
+	mkdir(unpack_dir, 0755);
+
+	// qopconv is run from other directories
+	char qopconv_path[MAX_PATH_LEN];
+	error_if(!realpath(o.qopconv, qopconv_path), "Could not find %s", o.qopconv);
+	o.qopconv = qopconv_path;
+
+	qop_uint64_t total_size;
+	char **paths = generate_tree(&o, tree_dir, &total_size);
+
+	printf("# qopbench files=%d sizes=%u:%u path_lens=%d:%d runs=%d flags=\"%s\"\n",
+		o.files, o.min_size, o.max_size, o.min_path_len, o.max_path_len, o.runs, o.pack_flags);
+	printf("# total_size=%llu\n", (unsigned long long)total_size);
+
+	bench_pack(&o, tree_dir, archive_path, total_size);
+	bench_unpack(&o, unpack_dir, archive_path, total_size);
+
+	bench_open("open_index", qop_open, archive_path, o.runs);
+	bench_open("open_index_mmap", qop_open_mmap, archive_path, o.runs);
+
+	qop_desc qop;
+	error_if(!qop_open(archive_path, &qop), "Could not open %s", archive_path);
+	void *hashmap = malloc(qop.hashmap_size);
+	error_if(!qop_read_index(&qop, hashmap), "Could not read index of %s", archive_path);
+	result("index_memory", (double)qop.hashmap_size / qop.index_len, "B/file");
+
+	bench_find(&qop, paths, o.files, o.runs);
+	bench_read(&qop, archive_path, total_size, o.max_size, o.runs);
+	bench_read_batch(&qop, archive_path, total_size, o.runs);
+	bench_read_stream(&qop, archive_path, total_size, o.runs);
+
+	qop_close(&qop);
+	free(hashmap);
+
+	for (int i = 0; i < o.files; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+
+	char cmd[MAX_PATH_LEN * 2];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", base_dir);
+	run(cmd);
+	return 0;
+}
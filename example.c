@@ -49,7 +49,8 @@ int main(int argc, char *argv[]) {
 	assert(archive_size > 0);
 
 	// Read the archive index
-	int index_len = qop_read_index(&qop, malloc(qop.hashmap_size));
+	void *index = malloc(qop.hashmap_size);
+	int index_len = qop_read_index(&qop, index);
 	assert(index_len > 0);
 
 	// Find a file
@@ -63,6 +64,6 @@ int main(int argc, char *argv[]) {
 	printf("%.*s\n", (int)file->size, contents);
 	free(contents);
 
-	free(qop.hashmap);
 	qop_close(&qop);
+	free(index);
 }
\ No newline at end of file
@@ -13,23 +13,73 @@ QOP - The “Quite OK Package Format” for bare bones file packages
 #define QOP_IMPLEMENTATION
 #include "qop.h"
 
+// All reads are positional (pread() on POSIX systems); no file position is
+// shared between calls. Once the index is loaded, qop_find(), qop_read_path(),
+// qop_read() and qop_read_ex() may be called from multiple threads on the same
+// qop_desc. On POSIX systems compiling with -std=c99 requires _DEFAULT_SOURCE
+// or _POSIX_C_SOURCE >= 200809L to be defined before including this file.
+
+// Files compressed with zstd (QOP_FLAG_COMPRESSED_ZSTD) are decompressed 
+// transparently by qop_read() and qop_read_ex(). This requires zstd: define
+// `QOP_ZSTD` together with `QOP_IMPLEMENTATION` and link with -lzstd. Without
+// it, reading a compressed file fails.
+
+// qop_read_batch() reads many files at once. On Linux all reads are submitted
+// together through io_uring (with raw syscalls; liburing is not needed). If 
+// io_uring is not available, or on other systems, the reads are distributed 
+// over QOP_BATCH_THREADS threads that use positional reads. This requires 
+// linking with -pthread on older POSIX systems. Define `QOP_NO_IO_URING` and/or
+// `QOP_NO_THREADS` to disable either; without both the reads are sequential.
+
+// You may define QOP_MALLOC and QOP_FREE before including this library to use
+// your own memory allocator. Memory is allocated for compressed files, the zstd
+// dictionary, streams and a path buffer when qop_mount_index() has to rehash 
+// paths. The index, the path table and uncompressed reads only use the buffers
+// you pass in.
+
+// Define `QOP_COMPACT_INDEX` (everywhere qop.h is included, as it changes 
+// qop_desc) to load the index into a compact table instead of the hashmap: 
+// the files are stored densely, without empty slots, and are found through 
+// groups of 1 byte tags that are compared at once (with SSE2 where available).
+// This needs about half the memory of the hashmap (~42 instead of 60-120 bytes
+// per file) and a qop_find() that misses usually touches a single cache line.
+// qop->hashmap then has qop->hashmap_len == qop->index_len files and no empty
+// slots. A prebuilt hashmap is not used.
+
 
 -- File format description (pseudo code)
 
 struct {
-	// Path string and data of all files in this archive
+	// Path string and data of all files in this archive. There may be padding
+	// in front of each path, e.g. to align the bytes. Only the offsets in the
+	// index are used to locate files.
 	struct {
+		uint8_t padding[];
 		uint8_t path[path_len];
 		uint8_t bytes[size];
 	} file_data[];
 
+	// Optional sections, located through the section directory below. Readers
+	// that don't know about sections never look past the file data, so they
+	// simply ignore them.
+	uint8_t section_data[];
+
+	// The section directory. Only present if section_magic matches.
+	struct {
+		uint32_t type;   // QOP_SECTION_*
+		uint64_t offset; // relative to the start of the archive
+		uint64_t size;
+	} section[section_count];
+	uint32_t section_count;
+	uint32_t section_magic; // Magic bytes "qops"
+
 	// The index, with a list of files
 	struct {
 		uint64_t hash;
 		uint32_t offset;
-		uint32_t size;
+		uint32_t size;      // number of bytes stored in the archive
 		uint16_t path_len;
-		uint16_t flags;
+		uint16_t flags;     // QOP_FLAG_*
 	} qop_file[];
 
 	// The number of files in the index
@@ -43,6 +93,132 @@ struct {
 } qop;
 
 
+-- Version 2
+
+Archives larger than 4 GB, or with files larger than 4 GB, use version 2 of
+the format. It only differs in the index and the header, which use 64 bit 
+offsets and sizes. The magic bytes tell the two versions apart. 
+
+struct {
+	uint8_t file_data[];
+	uint8_t section_data[];
+	uint8_t section_directory[];
+
+	struct {
+		uint64_t hash;
+		uint64_t offset;
+		uint64_t size;      // number of bytes stored in the archive
+		uint16_t path_len;
+		uint16_t flags;     // QOP_FLAG_*
+	} qop_file[];
+
+	uint32_t index_len;
+	uint32_t flags;         // hash type (QOP_HASH_*) in the lowest 8 bits,
+	                        // the other bits are reserved, 0
+	uint64_t archive_size;
+
+	// Magic bytes "qop2"
+	uint32_t magic;
+} qop2;
+
+
+The hash type tells the function that was used to hash the paths:
+
+QOP_HASH_MURMUR_OAAT: MurmurOAAT64, one byte at a time. The only hash of 
+version 1 archives.
+
+QOP_HASH_WORD64: 8 bytes at a time, each read as a little endian uint64_t. 
+The remaining 0-7 bytes are read as one little endian word. See 
+qop_hash_word64() for the details.
+
+
+-- Sections
+
+QOP_SECTION_HASHMAP: the prebuilt hashmap, exactly as qop_read_index() would 
+build it. Slots are stored in the memory layout of qop_file (little endian,
+zero padded to slot_size). The section should start at an 8 byte boundary, 
+so mapped archives can use it in place.
+
+struct {
+	uint32_t hashmap_len; // power of 2, larger than index_len
+	uint32_t slot_size;   // sizeof(qop_file)
+	struct {
+		uint64_t hash;
+		uint64_t offset;
+		uint64_t size;        // uncompressed size
+		uint64_t stored_size; // size in the index
+		uint32_t path_offset; // see QOP_SECTION_PATHS, set even without it
+		uint16_t path_len;
+		uint16_t flags;
+	} slot[hashmap_len]; // empty slots have a size of 0
+} hashmap;
+
+QOP_SECTION_PATHS: the paths of all files in index order, each null terminated
+and path_len bytes long. The offset of a path in this table is the sum of the
+path_len of all preceding index entries. With this section qop_find() compares
+the full path and paths can be read without seeking to each file.
+
+struct {
+	uint8_t path[path_len];
+} paths[index_len];
+
+QOP_SECTION_SORTED_PATHS: the offsets of all paths in QOP_SECTION_PATHS, 
+ordered by the byte wise comparison of the paths. Archives with this section 
+always have QOP_SECTION_PATHS. qop_iter_prefix() finds all files under a 
+directory with a binary search over these offsets.
+
+uint32_t path_offset[index_len];
+
+QOP_SECTION_SIZES: the uncompressed size of all files in index order. Present
+if any file in the archive is compressed. The size in the index is always the
+number of bytes stored in the archive.
+
+uint32_t size[index_len]; // uint64_t for version 2 archives
+
+QOP_SECTION_ZSTD_DICT: a zstd dictionary shared by all files that have the
+QOP_FLAG_ZSTD_DICT flag set (together with QOP_FLAG_COMPRESSED_ZSTD).
+
+uint8_t dict[];
+
+QOP_SECTION_ALIGN: the alignment (qopconv --align) of the file data, relative
+to the start of the archive. Readers don't need it; tools that add files to 
+the archive keep the data aligned to it.
+
+uint32_t align;
+
+
+-- Chunked files
+
+Large files with QOP_FLAG_ZSTD_CHUNKED (together with QOP_FLAG_COMPRESSED_ZSTD)
+are split into chunks of chunk_size bytes that are compressed independently.
+qop_read_ex() only decompresses the frames that overlap the requested range.
+A frame that is as long as its uncompressed chunk is stored as is.
+
+struct {
+	uint32_t chunk_size;
+	uint64_t frame_offset[frames_len + 1]; // relative to the start of bytes[];
+	                                       // frames_len = ceil(size/chunk_size)
+	uint8_t frames[];
+} bytes;
+
+
+-- Shared data
+
+Files with identical contents may share one copy of the data. For all but the
+first of them, QOP_FLAG_SHARED_DATA is set and no path is stored in front of
+the data: offset + path_len still points at the shared bytes, but the path
+must be taken from the QOP_SECTION_PATHS, which such archives always have. 
+Readers that ignore the flag can still read the data of all files.
+
+
+-- Checksums
+
+Files with QOP_FLAG_CHECKSUM have the XXH64 hash (seed 0) of their 
+uncompressed contents stored as a little endian uint64_t directly behind their
+stored bytes, i.e. at offset + path_len + stored_size. Files that share data
+share the checksum. Readers that ignore the flag are not affected.
+
+
 */
 
 
@@ -62,58 +238,330 @@ extern "C" {
 #define QOP_FLAG_NONE               0
 #define QOP_FLAG_COMPRESSED_ZSTD    (1 << 0)
 #define QOP_FLAG_COMPRESSED_DEFLATE (1 << 1)
+#define QOP_FLAG_ZSTD_DICT          (1 << 2)
+#define QOP_FLAG_ZSTD_CHUNKED       (1 << 3)
+#define QOP_FLAG_SHARED_DATA        (1 << 4)
+#define QOP_FLAG_CHECKSUM           (1 << 5)
 #define QOP_FLAG_ENCRYPTED          (1 << 8)
 
+#define QOP_SECTION_HASHMAP 1
+#define QOP_SECTION_PATHS   2
+#define QOP_SECTION_SIZES   3
+#define QOP_SECTION_ZSTD_DICT 4
+#define QOP_SECTION_SORTED_PATHS 5
+#define QOP_SECTION_ALIGN   6
+#define QOP_SECTION_MAX     8
+
+#define QOP_HASH_MURMUR_OAAT 0
+#define QOP_HASH_WORD64      1
+
 typedef struct {
 	unsigned long long hash;
-	unsigned int offset;
-	unsigned int size;
+	unsigned long long offset;
+	unsigned long long size;
+	unsigned long long stored_size;
+	unsigned int path_offset;
 	unsigned short path_len;
 	unsigned short flags;
 } qop_file;
 
+typedef struct {
+	unsigned long long offset;
+	unsigned long long size;
+} qop_section;
+
+#ifdef QOP_STATS
+// Counters that are updated while an archive is used, when QOP_STATS is
+// defined before including qop.h (everywhere it is included, as it changes 
+// qop_desc). Without QOP_STATS they are compiled out completely. The counters
+// are not atomic; with concurrent reads from multiple threads the numbers are
+// approximate. The load factor of the hashmap is
+// qop->index_len / qop->hashmap_len. All reads are positional, so there are no
+// seeks to count.
+typedef struct {
+	unsigned long long finds;        // calls of qop_find()
+	unsigned long long find_probes;  // hashmap slots (or groups, with
+	                                 // QOP_COMPACT_INDEX) visited by qop_find()
+	unsigned int find_max_probe;     // most slots visited by one qop_find()
+	unsigned long long inserts;      // files inserted while building the hashmap
+	unsigned long long insert_probes;// hashmap slots (groups) visited for the inserts
+	unsigned int insert_max_probe;   // most slots visited by one insert
+	unsigned long long reads;        // read calls issued to the OS
+	unsigned long long bytes_read;   // bytes copied from the archive file or
+	                                 // memory by the qop_read*() functions
+} qop_stats;
+#endif
+
 typedef struct {
 	FILE *fh;
+	const unsigned char *data;
+	unsigned long long data_size;
+	int data_is_mapped;
+	int verify;
+	unsigned int version;
+	unsigned int hash_type;
 	qop_file *hashmap;
-	unsigned int files_offset;
-	unsigned int index_offset;
+	unsigned long long files_offset;
+	unsigned long long index_offset;
 	unsigned int index_len;
 	unsigned int hashmap_len;
-	unsigned int hashmap_size;
+	unsigned long long hashmap_size;
+	const char *paths;
+	unsigned int paths_size;
+	void *zstd_ddict;
+	void *zstd_dctx;
+	qop_section sections[QOP_SECTION_MAX];
+	#ifdef QOP_COMPACT_INDEX
+		unsigned char *index_groups;
+		unsigned int index_groups_len;
+	#endif
+	#ifdef QOP_STATS
+		qop_stats stats;
+	#endif
 } qop_desc;
 
+#define QOP_ITER_BUFFER_LEN 64
+
+typedef struct {
+	qop_desc *qop;
+	unsigned int next;
+	unsigned int end;
+	unsigned int buffer_start;
+	unsigned int buffer_len;
+	unsigned int buffer[QOP_ITER_BUFFER_LEN];
+} qop_iter;
+
+typedef struct {
+	unsigned long long hash;
+	qop_file *file;         // NULL for an empty slot
+	qop_desc *archive;
+} qop_mount_entry;
+
+typedef struct {
+	qop_desc **archives;
+	unsigned int archives_len;
+	unsigned int hash_type;
+	qop_mount_entry *hashmap;
+	unsigned int hashmap_len;
+	unsigned long long hashmap_size;
+	unsigned int len;
+} qop_mount;
+
+typedef struct {
+	unsigned long long v[4];
+	unsigned long long total_len;
+	unsigned char buffer[32];
+	unsigned int buffer_len;
+} qop_checksum_state;
+
 // Open an archive at path. The supplied qop_desc will be filled with the
 // information from the file header. Returns the size of the archvie or 0 on
 // failure.
-int qop_open(const char *path, qop_desc *qop);
+unsigned long long qop_open(const char *path, qop_desc *qop);
+
+// Open an archive at path by mapping the whole file into memory. Behaves like
+// qop_open(), but reads are served from the mapping and qop_data() can be used
+// to access file contents without copying. qop->fh is NULL for mapped archives.
+// Returns the size of the archive or 0 on failure.
+unsigned long long qop_open_mmap(const char *path, qop_desc *qop);
+
+// Open an archive from a buffer in memory, e.g. an archive that was linked into
+// the executable. The buffer must stay valid until qop_close() is called; no
+// ownership is taken. No file I/O is done for an archive opened this way and 
+// qop_data() can be used to access file contents without copying.
+// Returns the size of the archive or 0 on failure.
+unsigned long long qop_open_memory(const void *data, size_t len, qop_desc *qop);
 
 // Read the index from an opened archive. The supplied buffer will be filled
-// with the index data and must be at least qop->hashmap_size bytes long.
+// with the index data and must be at least qop->hashmap_size bytes long (the
+// hashmap, or with QOP_COMPACT_INDEX the files and the compact table).
 // No ownership is taken of the buffer; if you allocated it with malloc() you
 // need to free() it yourself after qop_close();
+// If the archive contains a prebuilt hashmap, it is copied as is instead of
+// being rebuilt. For mapped and in-memory archives the prebuilt hashmap is
+// used in place if possible: qop->hashmap_size is then 0 after opening, the
+// buffer is ignored and qop->hashmap points into the archive. So always free
+// the buffer you passed in, never qop->hashmap.
+// If the archive has a shared zstd dictionary, it is loaded here, once.
 // Returns the number of files in the archive or 0 on error.
 int qop_read_index(qop_desc *qop, void *buffer);
 
-// Close the archive.
+// Read the path table from an opened archive, if it has one. The supplied
+// buffer will be filled with all paths and must be at least qop->paths_size 
+// bytes long. No ownership is taken of the buffer. For mapped and in-memory 
+// archives the path table is used in place and qop->paths is already set after
+// opening; qop->paths_size is then 0. 
+// Once the paths are loaded, qop_find() compares the full path, not just the 
+// hash and qop_read_path() does no I/O.
+// Returns the size of the path table or 0 if there is none or on error.
+int qop_read_paths(qop_desc *qop, void *buffer);
+
+// Close the archive. For archives opened with qop_open_mmap() this unmaps the
+// file; all pointers returned by qop_data() become invalid. The buffer of an
+// archive opened with qop_open_memory() is left untouched.
 void qop_close(qop_desc *qop);
 
 // Find a file with the supplied path. Returns NULL if the file is not found.
+// Without a loaded path table, only the hash of the path is compared.
 qop_file *qop_find(qop_desc *qop, const char *path);
 
+// Start iterating over all files whose path starts with prefix, e.g. 
+// "levels/12/". This requires an archive with a sorted path index (created 
+// with qopconv --sorted) and a loaded index and path table. The matches are 
+// found with two binary searches, so the cost depends on the number of matches,
+// not on the number of files in the archive.
+// Returns the number of matching files; 0 if there are none or if the archive
+// has no sorted path index.
+unsigned int qop_iter_prefix(qop_desc *qop, const char *prefix, qop_iter *iter);
+
+// Get the next file of an iteration started with qop_iter_prefix(). Files are
+// returned in the byte wise order of their paths. Entries are read in batches
+// of QOP_ITER_BUFFER_LEN.
+// Returns NULL after the last file.
+qop_file *qop_iter_next(qop_iter *iter);
+
+// Mount an ordered stack of archives, e.g. a base archive followed by patches,
+// so that all of them can be searched with a single lookup. Files in later
+// archives shadow files with the same path in earlier ones. The archives must
+// stay open and have their index (and paths, if any) loaded; no ownership is
+// taken of the archives array. This sets mount->hashmap_size, the size of the
+// buffer for qop_mount_index().
+void qop_mount_init(qop_mount *mount, qop_desc **archives, unsigned int len);
+
+// Build the merged hashmap of all mounted archives in the supplied buffer. 
+// Paths are hashed with the hash type of the last archive; files of archives
+// with a different hash type need their path, which is read from the archive
+// if its path table is not loaded. Files are shadowed if their hash is equal
+// and, if both archives have a loaded path table, their path.
+// Returns the number of distinct files or 0 on error.
+unsigned int qop_mount_index(qop_mount *mount, void *buffer);
+
+// Find a file in the mounted archives. The cost does not depend on the number
+// of archives. If archive is not NULL it is set to the archive of the file, to
+// be used with qop_read() and the other functions.
+// Returns NULL if the file is not found.
+qop_file *qop_mount_find(qop_mount *mount, const char *path, qop_desc **archive);
+
 // Copy the path of the file into dest. The dest buffer must be at least 
-// file->path_len bytes long. The path is null terminated.
+// file->path_len bytes long. The path is null terminated. If the path table
+// was loaded, no I/O is done. Files with QOP_FLAG_SHARED_DATA require the path
+// table.
 // Returns the path length (including the null terminater) or 0 on error.
 int qop_read_path(qop_desc *qop, qop_file *file, char *dest);
 
 // Read the whole file into dest. The dest buffer must be at least file->size
-// bytes long.
+// bytes long. Compressed files are decompressed; file->size is always the
+// uncompressed size, file->stored_size the size in the archive. If qop->verify
+// is set (it is 0 after opening), the contents of files with a checksum are 
+// verified and 0 is returned on a mismatch. qop_read_batch() verifies too;
+// qop_read_ex() and streams never do.
 // Returns the number of bytes read.
-int qop_read(qop_desc *qop, qop_file *file, unsigned char *dest);
+unsigned long long qop_read(qop_desc *qop, qop_file *file, unsigned char *dest);
+
+// Read the checksum of a file into checksum. 
+// Returns 1 on success or 0 if the file has no checksum (QOP_FLAG_CHECKSUM).
+int qop_read_checksum(qop_desc *qop, qop_file *file, unsigned long long *checksum);
+
+// Compute the checksum (XXH64) of data at once or incrementally: init, update
+// with all parts of the data in order, then final.
+unsigned long long qop_checksum(const void *data, unsigned long long len);
+void qop_checksum_init(qop_checksum_state *state);
+void qop_checksum_update(qop_checksum_state *state, const void *data, unsigned long long len);
+unsigned long long qop_checksum_final(qop_checksum_state *state);
 
 // Read part of a file into dest. The dest buffer must be at least len bytes
-// long.
-// Returns the number of bytes read.
-int qop_read_ex(qop_desc *qop, qop_file *file, unsigned char *dest, unsigned int start, unsigned int len);
+// long. For compressed files start and len refer to the uncompressed data. For
+// chunked files only the overlapping chunks are decompressed; other compressed 
+// files are decompressed as a whole.
+// Ranges that extend past the end of the file are cut off there.
+// Returns the number of bytes read, 0 if start is at or past the end.
+unsigned long long qop_read_ex(qop_desc *qop, qop_file *file, unsigned char *dest, unsigned long long start, unsigned long long len);
+
+typedef struct {
+	qop_file *file;
+	unsigned char *dest;             // at least file->size bytes
+	unsigned long long bytes_read;   // set by qop_read_batch()
+	void *user;                      // not used by qop
+} qop_read_request;
+
+typedef void (*qop_read_callback)(qop_read_request *request);
+
+// Read the whole contents of many files at once, like qop_read() for each
+// request. Uncompressed files of archives opened with qop_open() are read with
+// io_uring or in multiple threads (see above), so the device sees all requests
+// at once. Compressed files are decompressed like qop_read() does.
+// request->bytes_read is set when a request completes; it is file->size on 
+// success. The optional callback is called once per completed request, in the
+// order of completion, possibly from multiple threads concurrently.
+// Returns the number of requests that read the whole file.
+unsigned int qop_read_batch(qop_desc *qop, qop_read_request *requests, unsigned int len, qop_read_callback callback);
+
+typedef struct {
+	qop_desc *qop;
+	qop_file *file;
+	unsigned long long pos;
+	unsigned char *front;
+	unsigned char *back;
+	unsigned long long front_start;
+	unsigned long long front_len;
+	unsigned long long back_start;
+	int back_pending;
+	int failed;
+	void *ring;
+	void *zstd_dctx;
+	unsigned long long zstd_read;
+	unsigned long long zstd_in_len;
+	unsigned long long zstd_in_pos;
+} qop_stream;
+
+// Open a stream to read a file sequentially with a fixed amount of memory, 
+// e.g. to pipe a large file into a parser. Two buffers of QOP_STREAM_BUFFER_SIZE 
+// bytes (default 1 MB) are used: while one is consumed, the next part of the 
+// file is read into the other with io_uring on Linux. Otherwise a readahead 
+// hint is given for the next part. Chunked compressed files are decompressed
+// one buffer at a time, touching only the needed chunks. Other compressed 
+// files are decompressed incrementally with a zstd streaming context, reading
+// the compressed data through the second buffer; skipping ahead in those 
+// decompresses the skipped part. Uncompressed files of mapped and in-memory 
+// archives need no buffers.
+// Returns 1 on success or 0 if the buffers could not be allocated.
+int qop_stream_open(qop_desc *qop, qop_file *file, qop_stream *stream);
+
+// Read up to len bytes from the current position of the stream into dest.
+// Returns the number of bytes read; 0 at the end of the file or on error.
+unsigned long long qop_stream_read(qop_stream *stream, void *dest, unsigned long long len);
+
+// Skip up to len bytes without reading them. Skipping past the part of the file
+// that is buffered causes a seek.
+// Returns the number of bytes skipped.
+unsigned long long qop_stream_skip(qop_stream *stream, unsigned long long len);
+
+// Returns the current position in the (uncompressed) file.
+unsigned long long qop_stream_tell(qop_stream *stream);
+
+// Wait for any outstanding read and free the buffers of the stream. If an
+// io_uring read could not be waited for, the kernel may still write into the
+// buffers; they are not freed then.
+void qop_stream_close(qop_stream *stream);
+
+// Ask the OS to read the data of the given files ahead, e.g. for all files that
+// are loaded at startup. Files that follow each other in the archive (within 
+// 64 KB) are merged into one range, so that a run of files, as written by 
+// qopconv --order, becomes a single sequential readahead. Uses posix_fadvise()
+// for archives opened with qop_open() and madvise() for mapped archives. Does 
+// nothing for in-memory archives or on systems without these calls.
+void qop_prefetch(qop_desc *qop, qop_file **files, unsigned int len);
+
+// Get a pointer to the contents of a file in a mapped or in-memory archive. The
+// pointer is valid for file->size bytes until qop_close() is called. 
+// qopconv --align n aligns the data relative to the start of the archive. So
+// the pointer is only n byte aligned (for n up to the page size) if the archive
+// itself starts at such a boundary: a standalone archive opened with 
+// qop_open_mmap() does, one appended to an executable usually does not. Check
+// qop->files_offset if you depend on it.
+// Returns NULL if the archive was opened with qop_open(), if the file is
+// compressed or if it does not lie within the archive.
+const unsigned char *qop_data(qop_desc *qop, qop_file *file);
 
 
 #ifdef __cplusplus
@@ -128,13 +576,91 @@ Implementation */
 
 #ifdef QOP_IMPLEMENTATION
 
+#if defined(_WIN32)
+	#include <windows.h>
+	#include <io.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#ifdef QOP_ZSTD
+	#include <zstd.h>
+#endif
+
+// io_uring needs the kernel headers; without them (or a compiler that can't
+// tell) the batch reads fall back to threads
+#if defined(__linux__) && !defined(QOP_NO_IO_URING) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define QOP_IO_URING
+	#endif
+#endif
+
+#ifdef QOP_IO_URING
+	#include <errno.h>
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+#endif
+
+#if !defined(QOP_NO_THREADS) && !defined(_WIN32)
+	#include <pthread.h>
+#endif
+
+#ifndef QOP_BATCH_THREADS
+	#define QOP_BATCH_THREADS 8
+#endif
+
+#ifndef QOP_STREAM_BUFFER_SIZE
+	#define QOP_STREAM_BUFFER_SIZE (1024 * 1024)
+#endif
+
+#ifndef QOP_MALLOC
+	#include <stdlib.h>
+	#define QOP_MALLOC(sz) malloc(sz)
+	#define QOP_FREE(p)    free(p)
+#endif
+
+#if defined(_MSC_VER)
+	#define QOP_ATOMIC_EXCHANGE(ptr, value) InterlockedExchangePointer((PVOID volatile *)(ptr), (value))
+	#define QOP_ATOMIC_INCREMENT(ptr) (InterlockedIncrement((LONG volatile *)(ptr)) - 1)
+#else
+	#define QOP_ATOMIC_EXCHANGE(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_ACQ_REL)
+	#define QOP_ATOMIC_INCREMENT(ptr) __atomic_fetch_add((ptr), 1, __ATOMIC_ACQ_REL)
+#endif
+
 typedef unsigned long long qop_uint64_t;
 
+#if defined(QOP_COMPACT_INDEX) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+	#define QOP_SSE2
+#endif
+
+#ifdef QOP_STATS
+	#define QOP_STAT(...) __VA_ARGS__
+#else
+	#define QOP_STAT(...)
+#endif
+
 #define QOP_MAGIC \
 	(((unsigned int)'q') <<  0 | ((unsigned int)'o') <<  8 | \
 	 ((unsigned int)'p') << 16 | ((unsigned int)'f') << 24)
+#define QOP_MAGIC_V2 \
+	(((unsigned int)'q') <<  0 | ((unsigned int)'o') <<  8 | \
+	 ((unsigned int)'p') << 16 | ((unsigned int)'2') << 24)
+#define QOP_SECTIONS_MAGIC \
+	(((unsigned int)'q') <<  0 | ((unsigned int)'o') <<  8 | \
+	 ((unsigned int)'p') << 16 | ((unsigned int)'s') << 24)
 #define QOP_HEADER_SIZE 12
+#define QOP_HEADER_SIZE_V2 20
 #define QOP_INDEX_SIZE 20
+#define QOP_INDEX_SIZE_V2 28
+#define QOP_SECTION_SIZE 20
+#define QOP_SECTIONS_MAX_LEN 64
+#define QOP_HASHMAP_HEADER_SIZE 8
+#define QOP_HASHMAP_SLOT_SIZE 40
+#define QOP_INDEX_LEN_MAX (1u << 30)
 
 // MurmurOAAT64
 static inline qop_uint64_t qop_hash(const char *key) {
@@ -147,27 +673,17 @@ static inline qop_uint64_t qop_hash(const char *key) {
   	return h;
 }
 
-static unsigned short qop_read_16(FILE *fh) {
-	unsigned char b[sizeof(unsigned short)] = {0};
-	if (fread(b, sizeof(unsigned short), 1, fh) != 1) {
-		return 0;
-	}
+static unsigned short qop_get_16(const unsigned char *b) {
 	return (b[1] << 8) | b[0];
 }
 
-static unsigned int qop_read_32(FILE *fh) {
-	unsigned char b[sizeof(unsigned int)] = {0};
-	if (fread(b, sizeof(unsigned int), 1, fh) != 1) {
-		return 0;
-	}
-	return (b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+static unsigned int qop_get_32(const unsigned char *b) {
+	return 
+		((unsigned int)b[3] << 24) | ((unsigned int)b[2] << 16) | 
+		((unsigned int)b[1] <<  8) | ((unsigned int)b[0]);
 }
 
-static qop_uint64_t qop_read_64(FILE *fh) {
-	unsigned char b[sizeof(qop_uint64_t)] = {0};
-	if (fread(b, sizeof(qop_uint64_t), 1, fh) != 1) {
-		return 0;
-	}
+static qop_uint64_t qop_get_64(const unsigned char *b) {
 	return 
 		((qop_uint64_t)b[7] << 56) | ((qop_uint64_t)b[6] << 48) | 
 		((qop_uint64_t)b[5] << 40) | ((qop_uint64_t)b[4] << 32) |
@@ -175,108 +691,2055 @@ static qop_uint64_t qop_read_64(FILE *fh) {
 		((qop_uint64_t)b[1] <<  8) | ((qop_uint64_t)b[0]);
 }
 
-int qop_open(const char *path, qop_desc *qop) {
-	FILE *fh = fopen(path, "rb");
-	if (!fh) {
-		return 0;
+// Word at a time hash. Each 8 byte word is premultiplied independently, so 
+// only one xor, rotate and multiply per word are in the dependency chain. The
+// final mix is the one from MurmurHash3.
+static qop_uint64_t qop_hash_word64(const char *key) {
+	const unsigned char *p = (const unsigned char *)key;
+	size_t len = strlen(key);
+	qop_uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+	for (; len >= 8; len -= 8, p += 8) {
+		h ^= qop_get_64(p) * 0x87c37b91114253d5ull;
+		h = (h << 31 | h >> 33) * 0x4cf5ad432745937full;
+	}
+	if (len) {
+		qop_uint64_t k = 0;
+		for (size_t i = 0; i < len; i++) {
+			k |= (qop_uint64_t)p[i] << (i * 8);
+		}
+		h ^= k * 0x87c37b91114253d5ull;
+		h = (h << 31 | h >> 33) * 0x4cf5ad432745937full;
 	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
 
-	fseek(fh, 0, SEEK_END);
-	int size = ftell(fh);
-	if (size <= QOP_HEADER_SIZE || fseek(fh, size - QOP_HEADER_SIZE, SEEK_SET) != 0) {
-		fclose(fh);
-		return 0;
+static qop_uint64_t qop_hash_path(unsigned int hash_type, const char *key) {
+	return hash_type == QOP_HASH_WORD64 
+		? qop_hash_word64(key) 
+		: qop_hash(key);
+}
+
+// XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+#define QOP_XXH_PRIME_1 0x9E3779B185EBCA87ull
+#define QOP_XXH_PRIME_2 0xC2B2AE3D27D4EB4Full
+#define QOP_XXH_PRIME_3 0x165667B19E3779F9ull
+#define QOP_XXH_PRIME_4 0x85EBCA77C2B2AE63ull
+#define QOP_XXH_PRIME_5 0x27D4EB2F165667C5ull
+#define QOP_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline qop_uint64_t qop_xxh_round(qop_uint64_t acc, qop_uint64_t input) {
+	acc += input * QOP_XXH_PRIME_2;
+	acc = QOP_ROTL64(acc, 31);
+	return acc * QOP_XXH_PRIME_1;
+}
+
+static inline qop_uint64_t qop_xxh_merge(qop_uint64_t acc, qop_uint64_t v) {
+	acc ^= qop_xxh_round(0, v);
+	return acc * QOP_XXH_PRIME_1 + QOP_XXH_PRIME_4;
+}
+
+void qop_checksum_init(qop_checksum_state *state) {
+	state->v[0] = QOP_XXH_PRIME_1 + QOP_XXH_PRIME_2;
+	state->v[1] = QOP_XXH_PRIME_2;
+	state->v[2] = 0;
+	state->v[3] = 0 - QOP_XXH_PRIME_1;
+	state->total_len = 0;
+	state->buffer_len = 0;
+}
+
+// Consume as many 32 byte stripes as possible. Returns the number of bytes 
+// consumed.
+static qop_uint64_t qop_xxh_stripes(qop_checksum_state *state, const unsigned char *p, qop_uint64_t len) {
+	qop_uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+	const unsigned char *start = p;
+	for (; len >= 32; len -= 32, p += 32) {
+		v0 = qop_xxh_round(v0, qop_get_64(p +  0));
+		v1 = qop_xxh_round(v1, qop_get_64(p +  8));
+		v2 = qop_xxh_round(v2, qop_get_64(p + 16));
+		v3 = qop_xxh_round(v3, qop_get_64(p + 24));
 	}
+	state->v[0] = v0; state->v[1] = v1; state->v[2] = v2; state->v[3] = v3;
+	return p - start;
+}
 
-	qop->fh = fh;
-	qop->hashmap = NULL;
-	unsigned int index_len = qop_read_32(fh);
-	unsigned int archive_size = qop_read_32(fh);
-	unsigned int magic = qop_read_32(fh);
+void qop_checksum_update(qop_checksum_state *state, const void *data, unsigned long long len) {
+	const unsigned char *p = (const unsigned char *)data;
+	state->total_len += len;
 
-	// Check magic, make sure index_len is possible with the file size
-	if (
-		magic != QOP_MAGIC ||
-		index_len * QOP_INDEX_SIZE > (unsigned int)(size - QOP_HEADER_SIZE)
-	) {
-		fclose(fh);
-		return 0;
+	// Complete a partial stripe from the last update first
+	if (state->buffer_len) {
+		unsigned int n = 32 - state->buffer_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(state->buffer + state->buffer_len, p, n);
+		state->buffer_len += n;
+		p += n;
+		len -= n;
+		if (state->buffer_len < 32) {
+			return;
+		}
+		qop_xxh_stripes(state, state->buffer, 32);
+		state->buffer_len = 0;
+	}
+
+	qop_uint64_t consumed = qop_xxh_stripes(state, p, len);
+	memcpy(state->buffer, p + consumed, len - consumed);
+	state->buffer_len = len - consumed;
+}
+
+unsigned long long qop_checksum_final(qop_checksum_state *state) {
+	qop_uint64_t h;
+	if (state->total_len >= 32) {
+		h = 
+			QOP_ROTL64(state->v[0], 1) + QOP_ROTL64(state->v[1], 7) +
+			QOP_ROTL64(state->v[2], 12) + QOP_ROTL64(state->v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = qop_xxh_merge(h, state->v[i]);
+		}
+	}
+	else {
+		h = QOP_XXH_PRIME_5;
+	}
+	h += state->total_len;
+
+	const unsigned char *p = state->buffer;
+	unsigned int len = state->buffer_len;
+	for (; len >= 8; len -= 8, p += 8) {
+		h ^= qop_xxh_round(0, qop_get_64(p));
+		h = QOP_ROTL64(h, 27) * QOP_XXH_PRIME_1 + QOP_XXH_PRIME_4;
+	}
+	if (len >= 4) {
+		h ^= (qop_uint64_t)qop_get_32(p) * QOP_XXH_PRIME_1;
+		h = QOP_ROTL64(h, 23) * QOP_XXH_PRIME_2 + QOP_XXH_PRIME_3;
+		len -= 4;
+		p += 4;
 	}
+	for (; len > 0; len--, p++) {
+		h ^= *p * QOP_XXH_PRIME_5;
+		h = QOP_ROTL64(h, 11) * QOP_XXH_PRIME_1;
+	}
+
+	h ^= h >> 33;
+	h *= QOP_XXH_PRIME_2;
+	h ^= h >> 29;
+	h *= QOP_XXH_PRIME_3;
+	h ^= h >> 32;
+	return h;
+}
+
+unsigned long long qop_checksum(const void *data, unsigned long long len) {
+	qop_checksum_state state;
+	qop_checksum_init(&state);
+	qop_checksum_update(&state, data, len);
+	return qop_checksum_final(&state);
+}
+
+static int qop_is_little_endian(void) {
+	const unsigned short v = 1;
+	return *(const unsigned char *)&v == 1;
+}
 
-	// Find a good size for the hashmap: power of 2, at least 1.5x num entries
+// Find a good size for the hashmap: power of 2, at least 1.5x num entries and
+// always with at least one empty slot, so that probing terminates
+static unsigned int qop_hashmap_len_for(unsigned int index_len) {
 	unsigned int hashmap_len = 1;
 	unsigned int min_hashmap_len = index_len * 1.5;
-	while (hashmap_len < min_hashmap_len) {
+	while (hashmap_len < min_hashmap_len || hashmap_len <= index_len) {
 		hashmap_len <<= 1;
 	}
+	return hashmap_len;
+}
 
-	qop->files_offset  = size - archive_size;
-	qop->index_len = index_len;
-	qop->index_offset = size - qop->index_len * QOP_INDEX_SIZE - QOP_HEADER_SIZE;
-	qop->hashmap_len = hashmap_len;
-	qop->hashmap_size = qop->hashmap_len * sizeof(qop_file);
-	return size;	
+#ifdef QOP_STATS
+static void qop_count_probes(unsigned long long *count, unsigned long long *probes, unsigned int *max_probe, unsigned int n) {
+	*count += 1;
+	*probes += n;
+	if (n > *max_probe) {
+		*max_probe = n;
+	}
 }
+#endif
 
-int qop_read_index(qop_desc *qop, void *buffer) {
-	qop->hashmap = buffer;
-	int mask = qop->hashmap_len - 1;
+#ifdef QOP_COMPACT_INDEX
 
-	memset(qop->hashmap, 0, qop->hashmap_size);
-	fseek(qop->fh, qop->index_offset, SEEK_SET);
+// The compact index is a power of 2 number of groups of 16 bytes, each with 
+// the tags of 12 slots and the number of files in all groups before it. A tag
+// is the top 7 bits of the hash for a used slot or QOP_TAG_EMPTY. A hash 
+// selects its first group with its low bits; further groups are probed in 
+// triangular steps, which visits every group once. Slots of a group are used
+// front to back and nothing is ever removed, so the file of slot i in group g
+// is qop->hashmap[base of g + i], and a group with an empty slot ends a probe.
+#define QOP_GROUP_SIZE 16
+#define QOP_GROUP_SLOTS 12
+#define QOP_GROUP_SLOTS_MASK 0x0fff
+#define QOP_TAG_EMPTY 0x80
 
-	for (unsigned int i = 0; i < qop->index_len; i++) {
-		qop_uint64_t hash = qop_read_64(qop->fh);
+static inline unsigned char qop_tag(qop_uint64_t hash) {
+	return hash >> 57;
+}
 
-		int idx = hash & mask;
-		while (qop->hashmap[idx].size > 0) {
-			idx = (idx + 1) & mask;
-		}
-		qop->hashmap[idx].hash     = hash;
-		qop->hashmap[idx].offset   = qop_read_32(qop->fh);
-		qop->hashmap[idx].size     = qop_read_32(qop->fh);
-		qop->hashmap[idx].path_len = qop_read_16(qop->fh);
-		qop->hashmap[idx].flags    = qop_read_16(qop->fh);
+// Power of 2, with at most 7/8 of the slots used
+static unsigned int qop_index_groups_len_for(unsigned int index_len) {
+	unsigned int groups_len = 1;
+	while (groups_len * QOP_GROUP_SLOTS - groups_len * QOP_GROUP_SLOTS / 8 < index_len) {
+		groups_len <<= 1;
 	}
-	return qop->index_len;
+	return groups_len;
 }
 
-void qop_close(qop_desc *qop) {
-	fclose(qop->fh);
+static inline unsigned int qop_ctz(unsigned int v) {
+	#if defined(_MSC_VER)
+		unsigned long i;
+		_BitScanForward(&i, v);
+		return i;
+	#else
+		return __builtin_ctz(v);
+	#endif
 }
 
-qop_file *qop_find(qop_desc *qop, const char *path) {
-	if (qop->hashmap == NULL) {
-		return NULL;
-	}
+static inline unsigned int qop_group_base(const unsigned char *group) {
+	unsigned int base;
+	memcpy(&base, group + QOP_GROUP_SLOTS, sizeof(base));
+	return base;
+}
 
-	int mask = qop->hashmap_len - 1;
+#ifndef QOP_SSE2
+// Collect the high bit of each byte into the low 8 bits
+static inline unsigned int qop_byte_mask(qop_uint64_t v) {
+	return ((v >> 7) * 0x0102040810204080ull) >> 56;
+}
+#endif
 
-	qop_uint64_t hash = qop_hash(path);
-	int idx = hash & mask;
-	while (qop->hashmap[idx].size > 0) {
-		if (qop->hashmap[idx].hash == hash) {
-			return &qop->hashmap[idx];
+// Bit i is set if slot i of the group has the tag. Without SSE2 the result may
+// contain false positives (never empty slots), which the hash comparison 
+// rejects.
+static inline unsigned int qop_group_match(const unsigned char *group, unsigned char tag) {
+	#ifdef QOP_SSE2
+		__m128i tags = _mm_loadu_si128((const __m128i *)group);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag))) & QOP_GROUP_SLOTS_MASK;
+	#else
+		const qop_uint64_t lsb = 0x0101010101010101ull, msb = 0x8080808080808080ull;
+		qop_uint64_t a = qop_get_64(group) ^ (lsb * tag);
+		qop_uint64_t b = qop_get_32(group + 8) ^ (lsb * tag);
+		return (
+			qop_byte_mask((a - lsb) & ~a & msb) | 
+			qop_byte_mask((b - lsb) & ~b & msb) << 8
+		) & QOP_GROUP_SLOTS_MASK;
+	#endif
+}
+
+// Bit i is set if slot i of the group is empty
+static inline unsigned int qop_group_empty(const unsigned char *group) {
+	#ifdef QOP_SSE2
+		return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group)) & QOP_GROUP_SLOTS_MASK;
+	#else
+		return (
+			qop_byte_mask(qop_get_64(group) & 0x8080808080808080ull) |
+			qop_byte_mask(qop_get_32(group + 8) & 0x80808080ull) << 8
+		);
+	#endif
+}
+
+// Insert a hash into the first empty slot of its probe sequence. Returns the 
+// group and sets slot and the number of groups visited.
+static unsigned char *qop_index_insert(qop_desc *qop, qop_uint64_t hash, unsigned int *slot, unsigned int *probes) {
+	unsigned int group_mask = qop->index_groups_len - 1;
+	unsigned int g = hash & group_mask;
+	for (*probes = 1; ; (*probes)++) {
+		unsigned char *group = qop->index_groups + g * QOP_GROUP_SIZE;
+		unsigned int empty = qop_group_empty(group);
+		if (empty) {
+			*slot = qop_ctz(empty);
+			group[*slot] = qop_tag(hash);
+			return group;
 		}
+		g = (g + *probes) & group_mask;
+	}
+}
+
+#endif // QOP_COMPACT_INDEX
+
+// Returns the number of slots visited
+static inline unsigned int qop_hashmap_insert(qop_file *hashmap, unsigned int mask, const qop_file *file) {
+	unsigned int idx = file->hash & mask;
+	unsigned int probes = 1;
+	while (hashmap[idx].size > 0) {
 		idx = (idx + 1) & mask;
+		probes++;
 	}
-	return NULL;
+	hashmap[idx] = *file;
+	return probes;
 }
 
-int qop_read_path(qop_desc *qop, qop_file *file, char *dest) {
-	fseek(qop->fh, qop->files_offset + file->offset, SEEK_SET);
-	return fread(dest, 1, file->path_len, qop->fh);
+// Read len bytes from the absolute position offset in the archive file into
+// dest. Returns the number of bytes read.
+static qop_uint64_t qop_read_at(qop_desc *qop, qop_uint64_t offset, void *dest, qop_uint64_t len) {
+	if (qop->data) {
+		if (offset >= qop->data_size) {
+			return 0;
+		}
+		if (len > qop->data_size - offset) {
+			len = qop->data_size - offset;
+		}
+		memcpy(dest, qop->data + offset, len);
+		QOP_STAT(qop->stats.bytes_read += len;)
+		return len;
+	}
+
+	// Positional reads don't touch the file position of qop->fh, so multiple
+	// threads can read from the same archive concurrently.
+	qop_uint64_t bytes_read = 0;
+	#if defined(_WIN32)
+		HANDLE fh = (HANDLE)_get_osfhandle(_fileno(qop->fh));
+		while (bytes_read < len) {
+			OVERLAPPED ov = {0};
+			ov.Offset = (DWORD)(offset + bytes_read);
+			ov.OffsetHigh = (DWORD)((offset + bytes_read) >> 32);
+			DWORD n = 0;
+			DWORD request = len - bytes_read < (1 << 30) ? (DWORD)(len - bytes_read) : (1 << 30);
+			QOP_STAT(qop->stats.reads++;)
+			if (!ReadFile(fh, (char *)dest + bytes_read, request, &n, &ov) || n == 0) {
+				break;
+			}
+			bytes_read += n;
+		}
+	#else
+		int fd = fileno(qop->fh);
+		while (bytes_read < len) {
+			QOP_STAT(qop->stats.reads++;)
+			ssize_t n = pread(fd, (char *)dest + bytes_read, len - bytes_read, (off_t)offset + bytes_read);
+			if (n <= 0) {
+				break;
+			}
+			bytes_read += n;
+		}
+	#endif
+	QOP_STAT(qop->stats.bytes_read += bytes_read;)
+	return bytes_read;
 }
 
-int qop_read(qop_desc *qop, qop_file *file, unsigned char *dest) {
-	fseek(qop->fh, qop->files_offset + file->offset + file->path_len, SEEK_SET);
-	return fread(dest, 1, file->size, qop->fh);
+// Read the optional section directory in front of the index. Unknown section
+// types are ignored.
+static void qop_read_sections(qop_desc *qop) {
+	memset(qop->sections, 0, sizeof(qop->sections));
+
+	unsigned char b[QOP_SECTION_SIZE];
+	qop_uint64_t space = qop->index_offset - qop->files_offset;
+	if (
+		space < 8 ||
+		qop_read_at(qop, qop->index_offset - 8, b, 8) != 8 ||
+		qop_get_32(b + 4) != QOP_SECTIONS_MAGIC
+	) {
+		return;
+	}
+
+	unsigned int count = qop_get_32(b + 0);
+	if (count > QOP_SECTIONS_MAX_LEN || count * QOP_SECTION_SIZE > space - 8) {
+		return;
+	}
+	qop_uint64_t sections_end = space - 8 - count * QOP_SECTION_SIZE;
+	qop_uint64_t offset = qop->index_offset - 8 - count * QOP_SECTION_SIZE;
+	for (unsigned int i = 0; i < count; i++, offset += QOP_SECTION_SIZE) {
+		if (qop_read_at(qop, offset, b, QOP_SECTION_SIZE) != QOP_SECTION_SIZE) {
+			return;
+		}
+		unsigned int type = qop_get_32(b + 0);
+		qop_uint64_t section_offset = qop_get_64(b + 4);
+		qop_uint64_t section_size = qop_get_64(b + 12);
+		if (
+			type < QOP_SECTION_MAX &&
+			section_offset <= sections_end &&
+			section_size <= sections_end - section_offset
+		) {
+			qop->sections[type].offset = section_offset;
+			qop->sections[type].size = section_size;
+		}
+	}
 }
 
-int qop_read_ex(qop_desc *qop, qop_file *file, unsigned char *dest, unsigned int start, unsigned int len) {
-	fseek(qop->fh, qop->files_offset + file->offset + file->path_len + start, SEEK_SET);
-	return fread(dest, 1, len, qop->fh);
+// Read the header at the end of the archive and initialize the remaining
+// fields of qop. Returns the size of the archive or 0 on failure.
+static qop_uint64_t qop_open_header(qop_desc *qop, qop_uint64_t size) {
+	QOP_STAT(memset(&qop->stats, 0, sizeof(qop->stats));)
+	qop->verify = 0;
+	unsigned char header[QOP_HEADER_SIZE_V2];
+	if (
+		size <= QOP_HEADER_SIZE ||
+		qop_read_at(qop, size - 4, header, 4) != 4
+	) {
+		return 0;
+	}
+
+	// The magic bytes at the very end tell the version
+	qop->hashmap = NULL;
+	unsigned int magic = qop_get_32(header);
+	unsigned int index_len;
+	qop_uint64_t archive_size, index_size, header_size;
+	if (magic == QOP_MAGIC) {
+		if (qop_read_at(qop, size - QOP_HEADER_SIZE, header, QOP_HEADER_SIZE) != QOP_HEADER_SIZE) {
+			return 0;
+		}
+		qop->version = 1;
+		qop->hash_type = QOP_HASH_MURMUR_OAAT;
+		index_len = qop_get_32(header + 0);
+		archive_size = qop_get_32(header + 4);
+		index_size = QOP_INDEX_SIZE;
+		header_size = QOP_HEADER_SIZE;
+	}
+	else if (magic == QOP_MAGIC_V2) {
+		if (
+			size <= QOP_HEADER_SIZE_V2 ||
+			qop_read_at(qop, size - QOP_HEADER_SIZE_V2, header, QOP_HEADER_SIZE_V2) != QOP_HEADER_SIZE_V2
+		) {
+			return 0;
+		}
+		qop->version = 2;
+		qop->hash_type = qop_get_32(header + 4) & 0xff;
+		index_len = qop_get_32(header + 0);
+		archive_size = qop_get_64(header + 8);
+		index_size = QOP_INDEX_SIZE_V2;
+		header_size = QOP_HEADER_SIZE_V2;
+	}
+	else {
+		return 0;
+	}
+
+	// Make sure index_len and archive_size are possible with the file size and
+	// that we know the hash type. The archive must at least hold the index and
+	// the header, so that the files and sections end before the index. The 
+	// limit on index_len keeps the hashmap length within 32 bits.
+	if (
+		qop->hash_type > QOP_HASH_WORD64 ||
+		index_len > QOP_INDEX_LEN_MAX ||
+		index_len * index_size > size - header_size ||
+		archive_size > size ||
+		archive_size < index_len * index_size + header_size
+	) {
+		return 0;
+	}
+
+	qop->files_offset  = size - archive_size;
+	qop->index_len = index_len;
+	qop->index_offset = size - qop->index_len * index_size - header_size;
+	qop->hashmap_len = qop_hashmap_len_for(index_len);
+	qop->hashmap_size = (qop_uint64_t)qop->hashmap_len * sizeof(qop_file);
+	qop->paths = NULL;
+	qop->paths_size = 0;
+	qop->zstd_ddict = NULL;
+	qop->zstd_dctx = NULL;
+	qop_read_sections(qop);
+
+	// Use the path table in place for mapped archives, as long as it is
+	// properly terminated
+	qop_section *ps = &qop->sections[QOP_SECTION_PATHS];
+	if (ps->size) {
+		if (!qop->data) {
+			qop->paths_size = ps->size;
+		}
+		else if (qop->data[qop->files_offset + ps->offset + ps->size - 1] == '\0') {
+			qop->paths = (const char *)qop->data + qop->files_offset + ps->offset;
+		}
+	}
+
+	// The sorted path index is only usable together with the path table
+	qop_section *ss = &qop->sections[QOP_SECTION_SORTED_PATHS];
+	if (ps->size == 0 || ss->size < (qop_uint64_t)index_len * 4) {
+		ss->size = 0;
+	}
+
+	// Use the dimensions of the prebuilt hashmap, if present
+	qop_section *hs = &qop->sections[QOP_SECTION_HASHMAP];
+	if (hs->size < QOP_HASHMAP_HEADER_SIZE) {
+		hs->size = 0;
+	}
+	if (hs->size) {
+		unsigned char h[QOP_HASHMAP_HEADER_SIZE];
+		qop_read_at(qop, qop->files_offset + hs->offset, h, QOP_HASHMAP_HEADER_SIZE);
+		unsigned int hashmap_len = qop_get_32(h + 0);
+		unsigned int slot_size = qop_get_32(h + 4);
+		if (
+			slot_size != QOP_HASHMAP_SLOT_SIZE ||
+			hashmap_len <= index_len ||
+			(hashmap_len & (hashmap_len - 1)) != 0 ||
+			QOP_HASHMAP_HEADER_SIZE + (qop_uint64_t)hashmap_len * slot_size > hs->size
+		) {
+			hs->size = 0;
+		}
+		else {
+			qop->hashmap_len = hashmap_len;
+			qop->hashmap_size = (qop_uint64_t)qop->hashmap_len * sizeof(qop_file);
+			if (
+				qop->data &&
+				qop_is_little_endian() &&
+				sizeof(qop_file) == slot_size &&
+				((size_t)(qop->data + qop->files_offset + hs->offset + QOP_HASHMAP_HEADER_SIZE) & 7) == 0
+			) {
+				qop->hashmap_size = 0;
+			}
+		}
+	}
+
+	// The compact index is always built from the index: the files, followed
+	// by the groups
+	#ifdef QOP_COMPACT_INDEX
+		qop->hashmap_len = index_len;
+		qop->index_groups_len = qop_index_groups_len_for(index_len);
+		qop->hashmap_size = (qop_uint64_t)index_len * sizeof(qop_file) + qop->index_groups_len * QOP_GROUP_SIZE;
+	#endif
+
+	// The index must be addressable; this only fails with a 32 bit size_t
+	if ((size_t)qop->hashmap_size != qop->hashmap_size) {
+		return 0;
+	}
+	return size;
 }
 
+unsigned long long qop_open(const char *path, qop_desc *qop) {
+	FILE *fh = fopen(path, "rb");
+	if (!fh) {
+		return 0;
+	}
+
+	// ftell() is limited to 2 GB on some platforms
+	#if defined(_WIN32)
+		qop_uint64_t size = _filelengthi64(_fileno(fh));
+	#else
+		struct stat st;
+		qop_uint64_t size = fstat(fileno(fh), &st) == 0 ? (qop_uint64_t)st.st_size : 0;
+	#endif
+
+	qop->fh = fh;
+	qop->data = NULL;
+	qop->data_size = 0;
+	qop->data_is_mapped = 0;
+	if (!qop_open_header(qop, size)) {
+		fclose(fh);
+		return 0;
+	}
+	return size;
+}
+
+static void qop_unmap(qop_desc *qop) {
+	#if defined(_WIN32)
+		UnmapViewOfFile(qop->data);
+	#else
+		munmap((void *)qop->data, qop->data_size);
+	#endif
+	qop->data = NULL;
+}
+
+unsigned long long qop_open_mmap(const char *path, qop_desc *qop) {
+	#if defined(_WIN32)
+		HANDLE fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (fh == INVALID_HANDLE_VALUE) {
+			return 0;
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(fh, &file_size) || file_size.QuadPart == 0) {
+			CloseHandle(fh);
+			return 0;
+		}
+		HANDLE map = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+		CloseHandle(fh);
+		if (!map) {
+			return 0;
+		}
+		void *data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(map);
+		if (!data) {
+			return 0;
+		}
+		qop_uint64_t data_size = file_size.QuadPart;
+	#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return 0;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			return 0;
+		}
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			return 0;
+		}
+		qop_uint64_t data_size = st.st_size;
+	#endif
+
+	qop->fh = NULL;
+	qop->data = (const unsigned char *)data;
+	qop->data_size = data_size;
+	qop->data_is_mapped = 1;
+	qop_uint64_t size = qop_open_header(qop, data_size);
+	if (!size) {
+		qop_unmap(qop);
+	}
+	return size;
+}
+
+unsigned long long qop_open_memory(const void *data, size_t len, qop_desc *qop) {
+	if (!data) {
+		return 0;
+	}
+	qop->fh = NULL;
+	qop->data = (const unsigned char *)data;
+	qop->data_size = len;
+	qop->data_is_mapped = 0;
+	qop_uint64_t size = qop_open_header(qop, len);
+	if (!size) {
+		qop->data = NULL;
+	}
+	return size;
+}
+
+// Number of index entries decoded per block in qop_read_index()
+#define QOP_INDEX_BLOCK_LEN 512
+
+#ifndef QOP_COMPACT_INDEX
+// Copy the prebuilt hashmap section into the buffer. The hashmap slots are 
+// decoded block by block, just like the index.
+static int qop_read_hashmap(qop_desc *qop, void *buffer) {
+	qop_uint64_t offset = qop->files_offset + qop->sections[QOP_SECTION_HASHMAP].offset;
+	if (qop->hashmap_size == 0) {
+		qop->hashmap = (qop_file *)(qop->data + offset + QOP_HASHMAP_HEADER_SIZE);
+		return qop->index_len;
+	}
+
+	offset += QOP_HASHMAP_HEADER_SIZE;
+
+	qop->hashmap = buffer;
+	unsigned char block[QOP_INDEX_BLOCK_LEN * QOP_HASHMAP_SLOT_SIZE];
+	for (unsigned int i = 0; i < qop->hashmap_len; i += QOP_INDEX_BLOCK_LEN) {
+		unsigned int block_len = qop->hashmap_len - i;
+		if (block_len > QOP_INDEX_BLOCK_LEN) {
+			block_len = QOP_INDEX_BLOCK_LEN;
+		}
+		unsigned int block_size = block_len * QOP_HASHMAP_SLOT_SIZE;
+		if (qop_read_at(qop, offset + (qop_uint64_t)i * QOP_HASHMAP_SLOT_SIZE, block, block_size) != block_size) {
+			return 0;
+		}
+
+		const unsigned char *b = block;
+		qop_file *files = qop->hashmap + i;
+		for (unsigned int j = 0; j < block_len; j++, b += QOP_HASHMAP_SLOT_SIZE) {
+			files[j].hash     = qop_get_64(b +  0);
+			files[j].offset   = qop_get_64(b +  8);
+			files[j].size     = qop_get_64(b + 16);
+			files[j].stored_size = qop_get_64(b + 24);
+			files[j].path_offset = qop_get_32(b + 32);
+			files[j].path_len = qop_get_16(b + 36);
+			files[j].flags    = qop_get_16(b + 38);
+		}
+	}
+	return qop->index_len;
+}
+#endif
+
+// Create the decompression dictionary from the QOP_SECTION_ZSTD_DICT, if the
+// archive has one.
+static void qop_load_zstd_dict(qop_desc *qop) {
+	#ifdef QOP_ZSTD
+		qop_section *ds = &qop->sections[QOP_SECTION_ZSTD_DICT];
+		if (!ds->size || qop->zstd_ddict) {
+			return;
+		}
+		qop_uint64_t offset = qop->files_offset + ds->offset;
+		if (qop->data) {
+			qop->zstd_ddict = ZSTD_createDDict(qop->data + offset, ds->size);
+		}
+		else {
+			unsigned char *dict = QOP_MALLOC(ds->size);
+			if (dict && qop_read_at(qop, offset, dict, ds->size) == ds->size) {
+				qop->zstd_ddict = ZSTD_createDDict(dict, ds->size);
+			}
+			QOP_FREE(dict);
+		}
+	#else
+		(void)qop;
+	#endif
+}
+
+// Read and decode block_len entries of the index, starting at entry first, 
+// into files. The path offsets are counted on from path_offset.
+static int qop_read_index_block(qop_desc *qop, unsigned int first, unsigned int block_len, qop_file *files, unsigned int *path_offset) {
+	unsigned int index_size = qop->version == 2 ? QOP_INDEX_SIZE_V2 : QOP_INDEX_SIZE;
+	unsigned int sizes_size = qop->version == 2 ? 8 : 4;
+	unsigned char block[QOP_INDEX_BLOCK_LEN * QOP_INDEX_SIZE_V2];
+	unsigned char sizes[QOP_INDEX_BLOCK_LEN * 8];
+
+	qop_uint64_t offset = qop->index_offset + (qop_uint64_t)first * index_size;
+	unsigned int block_size = block_len * index_size;
+	const unsigned char *b = block;
+	if (qop->data) {
+		if (offset + block_size > qop->data_size) {
+			return 0;
+		}
+		b = qop->data + offset;
+	}
+	else if (qop_read_at(qop, offset, block, block_size) != block_size) {
+		return 0;
+	}
+
+	for (unsigned int j = 0; j < block_len; j++, b += index_size) {
+		if (qop->version == 2) {
+			files[j].hash     = qop_get_64(b +  0);
+			files[j].offset   = qop_get_64(b +  8);
+			files[j].size     = qop_get_64(b + 16);
+			files[j].path_len = qop_get_16(b + 24);
+			files[j].flags    = qop_get_16(b + 26);
+		}
+		else {
+			files[j].hash     = qop_get_64(b +  0);
+			files[j].offset   = qop_get_32(b +  8);
+			files[j].size     = qop_get_32(b + 12);
+			files[j].path_len = qop_get_16(b + 16);
+			files[j].flags    = qop_get_16(b + 18);
+		}
+		files[j].path_offset = *path_offset;
+		files[j].stored_size = files[j].size;
+		*path_offset += files[j].path_len;
+	}
+
+	// Uncompressed sizes
+	qop_section *ss = &qop->sections[QOP_SECTION_SIZES];
+	if (ss->size < (qop_uint64_t)qop->index_len * sizes_size) {
+		ss->size = 0;
+	}
+	if (ss->size) {
+		qop_uint64_t sizes_offset = qop->files_offset + ss->offset + (qop_uint64_t)first * sizes_size;
+		if (qop_read_at(qop, sizes_offset, sizes, block_len * sizes_size) != block_len * sizes_size) {
+			return 0;
+		}
+		for (unsigned int j = 0; j < block_len; j++) {
+			files[j].size = sizes_size == 8 
+				? qop_get_64(sizes + j * 8)
+				: qop_get_32(sizes + j * 4);
+		}
+	}
+	return 1;
+}
+
+#ifdef QOP_COMPACT_INDEX
+// Build the compact index in two passes over the index: the first only fills
+// the tags, to learn the base of each group; the second repeats the same 
+// inserts and stores each file at the base of its group + its slot.
+static int qop_read_index_compact(qop_desc *qop, void *buffer) {
+	qop->hashmap = buffer;
+	qop->index_groups = (unsigned char *)(qop->hashmap + qop->index_len);
+	qop_file files[QOP_INDEX_BLOCK_LEN];
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned int g = 0; g < qop->index_groups_len; g++) {
+			memset(qop->index_groups + g * QOP_GROUP_SIZE, QOP_TAG_EMPTY, QOP_GROUP_SLOTS);
+		}
+		unsigned int path_offset = 0;
+		for (unsigned int i = 0; i < qop->index_len; i += QOP_INDEX_BLOCK_LEN) {
+			unsigned int block_len = qop->index_len - i;
+			if (block_len > QOP_INDEX_BLOCK_LEN) {
+				block_len = QOP_INDEX_BLOCK_LEN;
+			}
+			if (!qop_read_index_block(qop, i, block_len, files, &path_offset)) {
+				return 0;
+			}
+
+			for (unsigned int j = 0; j < block_len; j++) {
+				unsigned int slot, probes;
+				unsigned char *group = qop_index_insert(qop, files[j].hash, &slot, &probes);
+				if (pass == 0) {
+					QOP_STAT(qop_count_probes(&qop->stats.inserts, &qop->stats.insert_probes, &qop->stats.insert_max_probe, probes);)
+				}
+				else {
+					qop->hashmap[qop_group_base(group) + slot] = files[j];
+				}
+			}
+		}
+
+		// The number of used slots in a group is the position of its first 
+		// empty slot
+		unsigned int base = 0;
+		for (unsigned int g = 0; pass == 0 && g < qop->index_groups_len; g++) {
+			unsigned char *group = qop->index_groups + g * QOP_GROUP_SIZE;
+			unsigned int empty = qop_group_empty(group);
+			memcpy(group + QOP_GROUP_SLOTS, &base, sizeof(base));
+			base += empty ? qop_ctz(empty) : QOP_GROUP_SLOTS;
+		}
+	}
+	return qop->index_len;
+}
+#endif
+
+int qop_read_index(qop_desc *qop, void *buffer) {
+	qop_load_zstd_dict(qop);
+	#ifdef QOP_COMPACT_INDEX
+		return qop_read_index_compact(qop, buffer);
+	#else
+		if (qop->sections[QOP_SECTION_HASHMAP].size) {
+			return qop_read_hashmap(qop, buffer);
+		}
+
+		qop->hashmap = buffer;
+		unsigned int mask = qop->hashmap_len - 1;
+		memset(qop->hashmap, 0, qop->hashmap_size);
+
+		// The index is read in large blocks (or used directly from memory for
+		// mapped archives), decoded in one pass and inserted into the hashmap
+		// afterwards.
+		qop_file files[QOP_INDEX_BLOCK_LEN];
+		unsigned int path_offset = 0;
+		for (unsigned int i = 0; i < qop->index_len; i += QOP_INDEX_BLOCK_LEN) {
+			unsigned int block_len = qop->index_len - i;
+			if (block_len > QOP_INDEX_BLOCK_LEN) {
+				block_len = QOP_INDEX_BLOCK_LEN;
+			}
+			if (!qop_read_index_block(qop, i, block_len, files, &path_offset)) {
+				return 0;
+			}
+			for (unsigned int j = 0; j < block_len; j++) {
+				QOP_STAT(unsigned int probes =) qop_hashmap_insert(qop->hashmap, mask, &files[j]);
+				QOP_STAT(qop_count_probes(&qop->stats.inserts, &qop->stats.insert_probes, &qop->stats.insert_max_probe, probes);)
+			}
+		}
+		return qop->index_len;
+	#endif
+}
+
+int qop_read_paths(qop_desc *qop, void *buffer) {
+	qop_section *ps = &qop->sections[QOP_SECTION_PATHS];
+	if (qop->paths) {
+		return ps->size;
+	}
+	if (!ps->size || !qop->paths_size) {
+		return 0;
+	}
+
+	char *paths = buffer;
+	if (
+		qop_read_at(qop, qop->files_offset + ps->offset, paths, ps->size) != ps->size ||
+		paths[ps->size - 1] != '\0'
+	) {
+		return 0;
+	}
+	qop->paths = paths;
+	return ps->size;
+}
+
+void qop_close(qop_desc *qop) {
+	#ifdef QOP_ZSTD
+		ZSTD_freeDCtx(qop->zstd_dctx);
+		ZSTD_freeDDict(qop->zstd_ddict);
+		qop->zstd_dctx = NULL;
+		qop->zstd_ddict = NULL;
+	#endif
+	if (qop->fh) {
+		fclose(qop->fh);
+	}
+	if (qop->data && qop->data_is_mapped) {
+		qop_unmap(qop);
+	}
+	qop->data = NULL;
+}
+
+// The path of a file in the loaded path table, or NULL if the path offset lies
+// outside of the table (in a malformed archive). The table is null terminated.
+static inline const char *qop_table_path(qop_desc *qop, qop_file *file) {
+	return file->path_offset < qop->sections[QOP_SECTION_PATHS].size 
+		? qop->paths + file->path_offset 
+		: NULL;
+}
+
+static inline int qop_path_equals(qop_desc *qop, qop_file *file, const char *path) {
+	const char *table_path = qop_table_path(qop, file);
+	return table_path && strcmp(table_path, path) == 0;
+}
+
+#ifdef QOP_COMPACT_INDEX
+static qop_file *qop_find_compact(qop_desc *qop, const char *path, qop_uint64_t hash) {
+	unsigned int group_mask = qop->index_groups_len - 1;
+	unsigned int g = hash & group_mask;
+	unsigned char tag = qop_tag(hash);
+	for (unsigned int probes = 1; probes <= group_mask + 1; probes++) {
+		const unsigned char *group = qop->index_groups + g * QOP_GROUP_SIZE;
+		for (unsigned int match = qop_group_match(group, tag); match; match &= match - 1) {
+			qop_file *file = &qop->hashmap[qop_group_base(group) + qop_ctz(match)];
+			if (
+				file->hash == hash &&
+				(!qop->paths || qop_path_equals(qop, file, path))
+			) {
+				QOP_STAT(qop_count_probes(&qop->stats.finds, &qop->stats.find_probes, &qop->stats.find_max_probe, probes);)
+				return file;
+			}
+		}
+		if (qop_group_empty(group)) {
+			QOP_STAT(qop_count_probes(&qop->stats.finds, &qop->stats.find_probes, &qop->stats.find_max_probe, probes);)
+			return NULL;
+		}
+		g = (g + probes) & group_mask;
+	}
+	return NULL;
+}
+#endif
+
+qop_file *qop_find(qop_desc *qop, const char *path) {
+	if (qop->hashmap == NULL) {
+		return NULL;
+	}
+
+	qop_uint64_t hash = qop_hash_path(qop->hash_type, path);
+	#ifdef QOP_COMPACT_INDEX
+		return qop_find_compact(qop, path, hash);
+	#endif
+
+	// A stored hashmap is used as is; if it is corrupt and has no empty slot,
+	// the probing still ends after visiting every slot once
+	unsigned int mask = qop->hashmap_len - 1;
+	unsigned int idx = hash & mask;
+	unsigned int probes = 1;
+	while (qop->hashmap[idx].size > 0 && probes <= qop->hashmap_len) {
+		if (
+			qop->hashmap[idx].hash == hash &&
+			(!qop->paths || qop_path_equals(qop, &qop->hashmap[idx], path))
+		) {
+			QOP_STAT(qop_count_probes(&qop->stats.finds, &qop->stats.find_probes, &qop->stats.find_max_probe, probes);)
+			return &qop->hashmap[idx];
+		}
+		idx = (idx + 1) & mask;
+		probes++;
+	}
+	QOP_STAT(qop_count_probes(&qop->stats.finds, &qop->stats.find_probes, &qop->stats.find_max_probe, probes);)
+	return NULL;
+}
+
+// Read count entries of the sorted path index, starting at entry first. Returns
+// 0 if the entries can not be read or point outside of the path table.
+static int qop_read_sorted(qop_desc *qop, unsigned int first, unsigned int count, unsigned int *dest) {
+	unsigned char b[QOP_ITER_BUFFER_LEN * 4];
+	qop_uint64_t offset = qop->files_offset + qop->sections[QOP_SECTION_SORTED_PATHS].offset + (qop_uint64_t)first * 4;
+	if (count > QOP_ITER_BUFFER_LEN || qop_read_at(qop, offset, b, count * 4) != count * 4) {
+		return 0;
+	}
+	qop_uint64_t paths_size = qop->sections[QOP_SECTION_PATHS].size;
+	for (unsigned int i = 0; i < count; i++) {
+		dest[i] = qop_get_32(b + i * 4);
+		if (dest[i] >= paths_size) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Find the first sorted entry whose path is not less than the prefix or, with
+// include_matches set, the first entry that is greater and doesn't start with
+// it. Returns qop->index_len if there is none.
+static unsigned int qop_search_sorted(qop_desc *qop, const char *prefix, size_t prefix_len, int include_matches) {
+	unsigned int low = 0;
+	unsigned int high = qop->index_len;
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+		unsigned int path_offset;
+		if (!qop_read_sorted(qop, mid, 1, &path_offset)) {
+			return qop->index_len;
+		}
+		int cmp = strncmp(qop->paths + path_offset, prefix, prefix_len);
+		if (cmp < 0 || (include_matches && cmp == 0)) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+unsigned int qop_iter_prefix(qop_desc *qop, const char *prefix, qop_iter *iter) {
+	iter->qop = qop;
+	iter->next = 0;
+	iter->end = 0;
+	iter->buffer_start = 0;
+	iter->buffer_len = 0;
+	if (
+		qop->hashmap == NULL || 
+		qop->paths == NULL || 
+		qop->sections[QOP_SECTION_SORTED_PATHS].size == 0
+	) {
+		return 0;
+	}
+
+	size_t prefix_len = strlen(prefix);
+	iter->next = qop_search_sorted(qop, prefix, prefix_len, 0);
+	iter->end = qop_search_sorted(qop, prefix, prefix_len, 1);
+	if (iter->end < iter->next) {
+		iter->end = iter->next;
+	}
+	return iter->end - iter->next;
+}
+
+qop_file *qop_iter_next(qop_iter *iter) {
+	while (iter->next < iter->end) {
+		if (iter->next - iter->buffer_start >= iter->buffer_len) {
+			unsigned int count = iter->end - iter->next;
+			if (count > QOP_ITER_BUFFER_LEN) {
+				count = QOP_ITER_BUFFER_LEN;
+			}
+			if (!qop_read_sorted(iter->qop, iter->next, count, iter->buffer)) {
+				iter->next = iter->end;
+				return NULL;
+			}
+			iter->buffer_start = iter->next;
+			iter->buffer_len = count;
+		}
+		unsigned int path_offset = iter->buffer[iter->next - iter->buffer_start];
+		iter->next++;
+		qop_file *file = qop_find(iter->qop, iter->qop->paths + path_offset);
+		if (file) {
+			return file;
+		}
+	}
+	return NULL;
+}
+
+void qop_mount_init(qop_mount *mount, qop_desc **archives, unsigned int len) {
+	unsigned int files_len = 0;
+	for (unsigned int i = 0; i < len; i++) {
+		files_len += archives[i]->index_len;
+	}
+	mount->archives = archives;
+	mount->archives_len = len;
+	mount->hash_type = len ? archives[len - 1]->hash_type : QOP_HASH_MURMUR_OAAT;
+	mount->hashmap = NULL;
+	mount->hashmap_len = qop_hashmap_len_for(files_len);
+	mount->hashmap_size = (qop_uint64_t)mount->hashmap_len * sizeof(qop_mount_entry);
+	mount->len = 0;
+}
+
+static int qop_mount_same_path(qop_mount_entry *a, qop_desc *archive, qop_file *file) {
+	if (!a->archive->paths || !archive->paths) {
+		return 1;
+	}
+	const char *path = qop_table_path(archive, file);
+	return path && qop_path_equals(a->archive, a->file, path);
+}
+
+unsigned int qop_mount_index(qop_mount *mount, void *buffer) {
+	mount->hashmap = buffer;
+	mount->len = 0;
+	memset(mount->hashmap, 0, mount->hashmap_size);
+	unsigned int mask = mount->hashmap_len - 1;
+	char *path = NULL;
+
+	// Insert the files of the last archive first; files of earlier archives 
+	// are skipped when they are already present
+	for (unsigned int a = mount->archives_len; a-- > 0;) {
+		qop_desc *archive = mount->archives[a];
+		if (!archive->hashmap) {
+			QOP_FREE(path);
+			return 0;
+		}
+
+		int rehash = archive->hash_type != mount->hash_type;
+		if (rehash && !archive->paths && !path) {
+			path = (char *)QOP_MALLOC(1 << 16);
+			if (!path) {
+				return 0;
+			}
+		}
+
+		for (unsigned int i = 0; i < archive->hashmap_len; i++) {
+			qop_file *file = &archive->hashmap[i];
+			if (file->size == 0) {
+				continue;
+			}
+
+			qop_uint64_t hash = file->hash;
+			if (rehash) {
+				const char *p = archive->paths 
+					? qop_table_path(archive, file)
+					: (qop_read_path(archive, file, path) ? path : NULL);
+				if (!p) {
+					QOP_FREE(path);
+					return 0;
+				}
+				hash = qop_hash_path(mount->hash_type, p);
+			}
+
+			unsigned int idx = hash & mask;
+			while (
+				mount->hashmap[idx].file && 
+				!(mount->hashmap[idx].hash == hash && qop_mount_same_path(&mount->hashmap[idx], archive, file))
+			) {
+				idx = (idx + 1) & mask;
+			}
+			if (!mount->hashmap[idx].file) {
+				mount->hashmap[idx] = (qop_mount_entry){.hash = hash, .file = file, .archive = archive};
+				mount->len++;
+			}
+		}
+	}
+	QOP_FREE(path);
+	return mount->len;
+}
+
+qop_file *qop_mount_find(qop_mount *mount, const char *path, qop_desc **archive) {
+	if (mount->hashmap == NULL) {
+		return NULL;
+	}
+
+	unsigned int mask = mount->hashmap_len - 1;
+	qop_uint64_t hash = qop_hash_path(mount->hash_type, path);
+	for (unsigned int idx = hash & mask; mount->hashmap[idx].file; idx = (idx + 1) & mask) {
+		qop_mount_entry *e = &mount->hashmap[idx];
+		if (
+			e->hash == hash &&
+			(!e->archive->paths || qop_path_equals(e->archive, e->file, path))
+		) {
+			if (archive) {
+				*archive = e->archive;
+			}
+			return e->file;
+		}
+	}
+	return NULL;
+}
+
+int qop_read_path(qop_desc *qop, qop_file *file, char *dest) {
+	if (qop->paths) {
+		if ((qop_uint64_t)file->path_offset + file->path_len > qop->sections[QOP_SECTION_PATHS].size) {
+			return 0;
+		}
+		memcpy(dest, qop->paths + file->path_offset, file->path_len);
+		return file->path_len;
+	}
+	if (file->flags & QOP_FLAG_SHARED_DATA) {
+		return 0;
+	}
+	return qop_read_at(qop, qop->files_offset + file->offset, dest, file->path_len);
+}
+
+#ifdef QOP_ZSTD
+
+// Get a pointer to len bytes at offset in the archive. For mapped archives
+// this points into the mapping, otherwise the bytes are read into buffer.
+static const unsigned char *qop_fetch(qop_desc *qop, qop_uint64_t offset, qop_uint64_t len, unsigned char *buffer) {
+	if (qop->data) {
+		if (offset > qop->data_size || len > qop->data_size - offset) {
+			return NULL;
+		}
+		return qop->data + offset;
+	}
+	if (qop_read_at(qop, offset, buffer, len) != len) {
+		return NULL;
+	}
+	return buffer;
+}
+
+// Take the cached decompression context. If another thread is using it, a new
+// one is created.
+static ZSTD_DCtx *qop_zstd_dctx_acquire(qop_desc *qop) {
+	ZSTD_DCtx *dctx = QOP_ATOMIC_EXCHANGE((ZSTD_DCtx **)&qop->zstd_dctx, (ZSTD_DCtx *)NULL);
+	return dctx ? dctx : ZSTD_createDCtx();
+}
+
+// Put the decompression context back into the cache
+static void qop_zstd_dctx_release(qop_desc *qop, ZSTD_DCtx *dctx) {
+	dctx = QOP_ATOMIC_EXCHANGE((ZSTD_DCtx **)&qop->zstd_dctx, dctx);
+	ZSTD_freeDCtx(dctx);
+}
+
+// Decompress a whole zstd compressed file into dest, which must be at least
+// file->size bytes long. Returns the number of bytes decompressed.
+static qop_uint64_t qop_read_zstd(qop_desc *qop, qop_file *file, unsigned char *dest) {
+	unsigned char *buffer = qop->data ? NULL : QOP_MALLOC(file->stored_size);
+	const unsigned char *src = qop_fetch(qop, qop->files_offset + file->offset + file->path_len, file->stored_size, buffer);
+	if (!src) {
+		QOP_FREE(buffer);
+		return 0;
+	}
+
+	ZSTD_DCtx *dctx = qop_zstd_dctx_acquire(qop);
+	size_t size;
+	if (file->flags & QOP_FLAG_ZSTD_DICT) {
+		size = qop->zstd_ddict 
+			? ZSTD_decompress_usingDDict(dctx, dest, file->size, src, file->stored_size, qop->zstd_ddict)
+			: 0;
+	}
+	else {
+		size = ZSTD_decompressDCtx(dctx, dest, file->size, src, file->stored_size);
+	}
+	qop_zstd_dctx_release(qop, dctx);
+	QOP_FREE(buffer);
+	return ZSTD_isError(size) ? 0 : size;
+}
+
+// Decompress the range start, len of a chunked file into dest. Only the frames
+// that overlap the range are read and decompressed.
+static qop_uint64_t qop_read_zstd_chunked(qop_desc *qop, qop_file *file, unsigned char *dest, qop_uint64_t start, qop_uint64_t len) {
+	if (start >= file->size) {
+		return 0;
+	}
+	if (len > file->size - start) {
+		len = file->size - start;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	qop_uint64_t offset = qop->files_offset + file->offset + file->path_len;
+	unsigned char h[4];
+	if (qop_read_at(qop, offset, h, 4) != 4) {
+		return 0;
+	}
+	unsigned int chunk_size = qop_get_32(h);
+	if (chunk_size == 0) {
+		return 0;
+	}
+
+	// Read the offsets of the frames that we need
+	qop_uint64_t first = start / chunk_size;
+	qop_uint64_t last = (start + len - 1) / chunk_size;
+	qop_uint64_t offsets_len = last - first + 2;
+	unsigned char *offsets = QOP_MALLOC(offsets_len * 8);
+	unsigned char *src_buffer = qop->data ? NULL : QOP_MALLOC(chunk_size);
+	unsigned char *frame_buffer = NULL;
+	ZSTD_DCtx *dctx = qop_zstd_dctx_acquire(qop);
+	qop_uint64_t bytes_read = 0;
+
+	if (!offsets || qop_read_at(qop, offset + 4 + first * 8, offsets, offsets_len * 8) != offsets_len * 8) {
+		goto done;
+	}
+
+	for (qop_uint64_t i = first; i <= last; i++) {
+		qop_uint64_t frame_start = qop_get_64(offsets + (i - first) * 8);
+		qop_uint64_t frame_end = qop_get_64(offsets + (i - first + 1) * 8);
+		qop_uint64_t frame_pos = i * chunk_size;
+		unsigned int frame_len = file->size - frame_pos < chunk_size ? file->size - frame_pos : chunk_size;
+		if (frame_end < frame_start || frame_end - frame_start > frame_len) {
+			goto done;
+		}
+		unsigned int stored_len = frame_end - frame_start;
+		const unsigned char *src = qop_fetch(qop, offset + frame_start, stored_len, src_buffer);
+		if (!src) {
+			goto done;
+		}
+
+		// Decompress into dest directly, if the whole frame is needed. Otherwise
+		// decompress into a temporary buffer and copy the part we need.
+		unsigned int copy_start = start > frame_pos ? start - frame_pos : 0;
+		unsigned int copy_end = start + len - frame_pos < frame_len ? start + len - frame_pos : frame_len;
+		int partial = copy_start > 0 || copy_end < frame_len;
+		if (partial && !frame_buffer && !(frame_buffer = QOP_MALLOC(chunk_size))) {
+			goto done;
+		}
+		unsigned char *frame_dest = partial ? frame_buffer : dest + bytes_read;
+
+		// Frames that didn't compress are stored as is
+		if (stored_len == frame_len) {
+			memcpy(frame_dest, src, frame_len);
+		}
+		else if (ZSTD_decompressDCtx(dctx, frame_dest, frame_len, src, stored_len) != frame_len) {
+			goto done;
+		}
+		if (partial) {
+			memcpy(dest + bytes_read, frame_buffer + copy_start, copy_end - copy_start);
+		}
+		bytes_read += copy_end - copy_start;
+	}
+
+done:
+	qop_zstd_dctx_release(qop, dctx);
+	QOP_FREE(frame_buffer);
+	QOP_FREE(src_buffer);
+	QOP_FREE(offsets);
+	return bytes_read;
+}
+
+#endif /* QOP_ZSTD */
+
+int qop_read_checksum(qop_desc *qop, qop_file *file, unsigned long long *checksum) {
+	unsigned char b[8];
+	if (
+		!(file->flags & QOP_FLAG_CHECKSUM) ||
+		qop_read_at(qop, qop->files_offset + file->offset + file->path_len + file->stored_size, b, 8) != 8
+	) {
+		return 0;
+	}
+	*checksum = qop_get_64(b);
+	return 1;
+}
+
+// Check the contents of a file that was read completely, if qop->verify is 
+// set. Returns bytes_read, or 0 if the checksum doesn't match.
+static qop_uint64_t qop_verify(qop_desc *qop, qop_file *file, const unsigned char *data, qop_uint64_t bytes_read) {
+	unsigned long long checksum;
+	if (
+		qop->verify && 
+		bytes_read == file->size &&
+		qop_read_checksum(qop, file, &checksum) && 
+		qop_checksum(data, bytes_read) != checksum
+	) {
+		return 0;
+	}
+	return bytes_read;
+}
+
+unsigned long long qop_read(qop_desc *qop, qop_file *file, unsigned char *dest) {
+	qop_uint64_t bytes_read = 0;
+	if (file->flags & QOP_FLAG_COMPRESSED_ZSTD) {
+		#ifdef QOP_ZSTD
+			bytes_read = file->flags & QOP_FLAG_ZSTD_CHUNKED
+				? qop_read_zstd_chunked(qop, file, dest, 0, file->size)
+				: qop_read_zstd(qop, file, dest);
+		#endif
+	}
+	else {
+		bytes_read = qop_read_at(qop, qop->files_offset + file->offset + file->path_len, dest, file->size);
+	}
+	return qop_verify(qop, file, dest, bytes_read);
+}
+
+unsigned long long qop_read_ex(qop_desc *qop, qop_file *file, unsigned char *dest, unsigned long long start, unsigned long long len) {
+	// Never read past the file into the path and data of the next one
+	if (start >= file->size) {
+		return 0;
+	}
+	if (len > file->size - start) {
+		len = file->size - start;
+	}
+
+	if (file->flags & QOP_FLAG_COMPRESSED_ZSTD) {
+		#ifdef QOP_ZSTD
+			if (file->flags & QOP_FLAG_ZSTD_CHUNKED) {
+				return qop_read_zstd_chunked(qop, file, dest, start, len);
+			}
+			unsigned char *buffer = QOP_MALLOC(file->size);
+			if (!buffer || qop_read_zstd(qop, file, buffer) != file->size) {
+				QOP_FREE(buffer);
+				return 0;
+			}
+			memcpy(dest, buffer + start, len);
+			QOP_FREE(buffer);
+			return len;
+		#else
+			return 0;
+		#endif
+	}
+	return qop_read_at(qop, qop->files_offset + file->offset + file->path_len + start, dest, len);
+}
+
+const unsigned char *qop_data(qop_desc *qop, qop_file *file) {
+	qop_uint64_t start = qop->files_offset + file->offset + file->path_len;
+	if (
+		!qop->data || 
+		(file->flags & QOP_FLAG_COMPRESSED_ZSTD) ||
+		start > qop->data_size ||
+		file->size > qop->data_size - start
+	) {
+		return NULL;
+	}
+	return qop->data + start;
+}
+
+#define QOP_PREFETCH_MAX_GAP (64 * 1024)
+
+static void qop_prefetch_range(qop_desc *qop, qop_uint64_t start, qop_uint64_t end) {
+	#if defined(_WIN32)
+		(void)qop; (void)start; (void)end;
+	#else
+		if (qop->data_is_mapped) {
+			#if defined(MADV_WILLNEED)
+				qop_uint64_t page_size = sysconf(_SC_PAGESIZE);
+				qop_uint64_t aligned = start & ~(page_size - 1);
+				madvise((void *)(qop->data + aligned), end - aligned, MADV_WILLNEED);
+			#endif
+		}
+		else if (qop->fh) {
+			#if defined(POSIX_FADV_WILLNEED)
+				posix_fadvise(fileno(qop->fh), start, end - start, POSIX_FADV_WILLNEED);
+			#elif defined(F_RDADVISE)
+				while (start < end) {
+					struct radvisory ra;
+					ra.ra_offset = start;
+					ra.ra_count = end - start < (1 << 30) ? (int)(end - start) : (1 << 30);
+					fcntl(fileno(qop->fh), F_RDADVISE, &ra);
+					start += ra.ra_count;
+				}
+			#endif
+		}
+	#endif
+}
+
+void qop_prefetch(qop_desc *qop, qop_file **files, unsigned int len) {
+	if (qop->data && !qop->data_is_mapped) {
+		return;
+	}
+
+	qop_uint64_t start = 0;
+	qop_uint64_t end = 0;
+	for (unsigned int i = 0; i < len; i++) {
+		qop_uint64_t file_start = qop->files_offset + files[i]->offset + files[i]->path_len;
+		qop_uint64_t file_end = file_start + files[i]->stored_size;
+		if (end > start && file_start >= start && file_start <= end + QOP_PREFETCH_MAX_GAP) {
+			if (file_end > end) {
+				end = file_end;
+			}
+			continue;
+		}
+		if (end > start) {
+			qop_prefetch_range(qop, start, end);
+		}
+		start = file_start;
+		end = file_end;
+	}
+	if (end > start) {
+		qop_prefetch_range(qop, start, end);
+	}
+}
+
+static inline int qop_read_is_plain(qop_desc *qop, qop_file *file) {
+	return !qop->data && !(file->flags & QOP_FLAG_COMPRESSED_ZSTD);
+}
+
+static void qop_complete_request(qop_read_request *request, qop_uint64_t bytes_read, qop_read_callback callback) {
+	request->bytes_read = bytes_read;
+	if (callback) {
+		callback(request);
+	}
+}
+
+#ifdef QOP_IO_URING
+
+#define QOP_URING_DEPTH 128
+#define QOP_URING_MAX_READ (1 << 30)
+
+typedef struct {
+	int fd;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int entries;
+	unsigned int unsubmitted;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+} qop_uring;
+
+static void qop_uring_close(qop_uring *ring) {
+	if (ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+	if (ring->sq_ptr != MAP_FAILED) {
+		munmap(ring->sq_ptr, ring->sq_size);
+	}
+	close(ring->fd);
+}
+
+// Set up an io_uring and map its queues. Returns 0 if io_uring is not 
+// supported by the kernel or not permitted.
+static int qop_uring_init(qop_uring *ring, unsigned int entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		return 0;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->unsubmitted = 0;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP)
+		? ring->sq_ptr
+		: mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		qop_uring_close(ring);
+		return 0;
+	}
+
+	unsigned char *sq = (unsigned char *)ring->sq_ptr;
+	unsigned char *cq = (unsigned char *)ring->cq_ptr;
+	ring->sq_head  = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->cq_head  = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail  = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 1;
+}
+
+// Queue a read of len bytes at offset into dest. Reads longer than 
+// QOP_URING_MAX_READ come back short. The read is submitted by the next 
+// qop_uring_enter(). Returns 0 if the submission queue is full.
+static int qop_uring_queue_read(qop_uring *ring, int fd, qop_uint64_t offset, void *dest, qop_uint64_t len, qop_uint64_t user_data) {
+	unsigned int tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+		return 0;
+	}
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)dest;
+	sqe->len = len < QOP_URING_MAX_READ ? len : QOP_URING_MAX_READ;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->unsubmitted++;
+	return 1;
+}
+
+// Submit all queued reads and wait for at least min_complete completions. 
+// Returns 0 on error.
+static int qop_uring_enter(qop_uring *ring, unsigned int min_complete) {
+	while (1) {
+		int submitted = syscall(
+			__NR_io_uring_enter, ring->fd, ring->unsubmitted, min_complete, 
+			min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0
+		);
+		if (submitted >= 0) {
+			ring->unsubmitted -= submitted;
+			return 1;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			return 0;
+		}
+	}
+}
+
+// Take back the last queued read, if the kernel has not taken it from the 
+// submission queue yet. Returns 0 if it has.
+static int qop_uring_unqueue(qop_uring *ring) {
+	unsigned int tail = *ring->sq_tail;
+	if (tail == __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	__atomic_store_n(ring->sq_tail, tail - 1, __ATOMIC_RELEASE);
+	ring->unsubmitted--;
+	return 1;
+}
+
+// Take the next completion from the queue. Returns 0 if there is none.
+static int qop_uring_reap(qop_uring *ring, qop_uint64_t *user_data, int *res) {
+	unsigned int head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// Finish a completed read of len bytes at offset. Reads that failed or came 
+// back short (e.g. IORING_OP_READ is not supported by an old kernel) are 
+// completed with qop_read_at(). Returns the number of bytes read.
+static qop_uint64_t qop_uring_finish_read(qop_desc *qop, qop_uint64_t offset, unsigned char *dest, qop_uint64_t len, int res) {
+	qop_uint64_t bytes_read = res > 0 ? (qop_uint64_t)res : 0;
+	QOP_STAT(qop->stats.reads++; qop->stats.bytes_read += bytes_read;)
+	if (bytes_read < len) {
+		bytes_read += qop_read_at(qop, offset + bytes_read, dest + bytes_read, len - bytes_read);
+	}
+	return bytes_read;
+}
+
+// Complete all reads of the batch that are in the completion queue. Returns
+// the number of completed reads.
+static unsigned int qop_read_batch_reap(qop_desc *qop, qop_uring *ring, qop_read_request *requests, qop_read_callback callback) {
+	unsigned int reaped = 0;
+	qop_uint64_t i;
+	int res;
+	while (qop_uring_reap(ring, &i, &res)) {
+		qop_read_request *r = &requests[i];
+		qop_uint64_t offset = qop->files_offset + r->file->offset + r->file->path_len;
+		qop_uint64_t bytes_read = qop_uring_finish_read(qop, offset, r->dest, r->file->size, res);
+		qop_complete_request(r, qop_verify(qop, r->file, r->dest, bytes_read), callback);
+		reaped++;
+	}
+	return reaped;
+}
+
+// Returns 1 if the read for request i is still in the submission queue, i.e. 
+// was never taken by the kernel
+static int qop_uring_is_queued(qop_uring *ring, qop_uint64_t i) {
+	unsigned int tail = *ring->sq_tail;
+	for (unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE); head != tail; head++) {
+		if (ring->sqes[ring->sq_array[head & *ring->sq_mask]].user_data == i) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Read the plain files of the batch through io_uring, keeping up to 
+// ring->entries reads in flight. Returns 0 if io_uring can not be used at all.
+static int qop_read_batch_uring(qop_desc *qop, qop_read_request *requests, unsigned int len, qop_read_callback callback) {
+	qop_uring ring;
+	if (!qop_uring_init(&ring, QOP_URING_DEPTH)) {
+		return 0;
+	}
+
+	int fd = fileno(qop->fh);
+	unsigned int next = 0;
+	unsigned int in_flight = 0;
+	while (1) {
+		// Queue as many reads as there is room for
+		for (; next < len && in_flight < ring.entries; next++) {
+			qop_read_request *r = &requests[next];
+			if (!qop_read_is_plain(qop, r->file)) {
+				continue;
+			}
+			qop_uint64_t offset = qop->files_offset + r->file->offset + r->file->path_len;
+			if (!qop_uring_queue_read(&ring, fd, offset, r->dest, r->file->size, next)) {
+				break;
+			}
+			in_flight++;
+		}
+		if (in_flight == 0) {
+			break;
+		}
+
+		// Give up on errors. The reads the kernel already took may still write
+		// into their dest buffers, so wait for them before the ring is torn 
+		// down. Reads that were never submitted stay pending and are read 
+		// synchronously.
+		if (!qop_uring_enter(&ring, 1)) {
+			in_flight -= *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+			ring.unsubmitted = 0;
+			while (in_flight > 0) {
+				in_flight -= qop_read_batch_reap(qop, &ring, requests, callback);
+				if (in_flight > 0 && !qop_uring_enter(&ring, 1)) {
+					// Can't even wait: fail the remaining submitted reads rather
+					// than reading into the same buffers again
+					for (unsigned int i = 0; i < next; i++) {
+						qop_read_request *r = &requests[i];
+						if (
+							r->bytes_read == (qop_uint64_t)-1 &&
+							qop_read_is_plain(qop, r->file) &&
+							!qop_uring_is_queued(&ring, i)
+						) {
+							qop_complete_request(r, 0, callback);
+						}
+					}
+					break;
+				}
+			}
+			break;
+		}
+		in_flight -= qop_read_batch_reap(qop, &ring, requests, callback);
+	}
+	qop_uring_close(&ring);
+	return 1;
+}
+
+#endif /* QOP_IO_URING */
+
+#ifndef QOP_NO_THREADS
+
+typedef struct {
+	qop_desc *qop;
+	qop_read_request *requests;
+	unsigned int len;
+	unsigned int next;
+	int plain;
+	qop_read_callback callback;
+} qop_batch;
+
+#if defined(_WIN32)
+static DWORD WINAPI qop_batch_worker(LPVOID arg) {
+#else
+static void *qop_batch_worker(void *arg) {
+#endif
+	qop_batch *batch = (qop_batch *)arg;
+	unsigned int i;
+	while ((i = QOP_ATOMIC_INCREMENT(&batch->next)) < batch->len) {
+		qop_read_request *r = &batch->requests[i];
+		if (qop_read_is_plain(batch->qop, r->file) == batch->plain) {
+			qop_complete_request(r, qop_read(batch->qop, r->file, r->dest), batch->callback);
+		}
+	}
+	return 0;
+}
+
+// Read either the plain or all other requests in multiple threads. Returns 0
+// if no thread could be created.
+static int qop_read_batch_threads(qop_desc *qop, qop_read_request *requests, unsigned int len, int plain, qop_read_callback callback) {
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < len; i++) {
+		count += qop_read_is_plain(qop, requests[i].file) == plain;
+	}
+	if (count < 2) {
+		return 0;
+	}
+
+	qop_batch batch = {qop, requests, len, 0, plain, callback};
+	unsigned int threads_len = count < QOP_BATCH_THREADS ? count : QOP_BATCH_THREADS;
+	unsigned int created = 0;
+	#if defined(_WIN32)
+		HANDLE threads[QOP_BATCH_THREADS];
+		for (; created < threads_len; created++) {
+			threads[created] = CreateThread(NULL, 0, qop_batch_worker, &batch, 0, NULL);
+			if (!threads[created]) {
+				break;
+			}
+		}
+		for (unsigned int i = 0; i < created; i++) {
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+	#else
+		pthread_t threads[QOP_BATCH_THREADS];
+		for (; created < threads_len; created++) {
+			if (pthread_create(&threads[created], NULL, qop_batch_worker, &batch) != 0) {
+				break;
+			}
+		}
+		for (unsigned int i = 0; i < created; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	#endif
+	return created > 0;
+}
+
+#endif /* QOP_NO_THREADS */
+
+unsigned int qop_read_batch(qop_desc *qop, qop_read_request *requests, unsigned int len, qop_read_callback callback) {
+	// Mark all requests as pending
+	for (unsigned int i = 0; i < len; i++) {
+		requests[i].bytes_read = (qop_uint64_t)-1;
+	}
+
+	#ifdef QOP_IO_URING
+		int plain_done = qop->fh && qop_read_batch_uring(qop, requests, len, callback);
+	#else
+		int plain_done = 0;
+	#endif
+	#ifndef QOP_NO_THREADS
+		if (!plain_done) {
+			qop_read_batch_threads(qop, requests, len, 1, callback);
+		}
+		qop_read_batch_threads(qop, requests, len, 0, callback);
+	#else
+		(void)plain_done;
+	#endif
+
+	// Everything that is left: compressed files, mapped and in-memory archives
+	// or all files if neither io_uring nor threads are available
+	unsigned int complete = 0;
+	for (unsigned int i = 0; i < len; i++) {
+		qop_read_request *r = &requests[i];
+		if (r->bytes_read == (qop_uint64_t)-1) {
+			qop_complete_request(r, qop_read(qop, r->file, r->dest), callback);
+		}
+		if (r->bytes_read == r->file->size) {
+			complete++;
+		}
+	}
+	return complete;
+}
+
+
+int qop_stream_open(qop_desc *qop, qop_file *file, qop_stream *stream) {
+	memset(stream, 0, sizeof(*stream));
+	stream->qop = qop;
+	stream->file = file;
+	if (qop->data && !(file->flags & QOP_FLAG_COMPRESSED_ZSTD)) {
+		return 1;
+	}
+
+	stream->front = (unsigned char *)QOP_MALLOC(QOP_STREAM_BUFFER_SIZE * 2);
+	if (!stream->front) {
+		return 0;
+	}
+	stream->back = stream->front + QOP_STREAM_BUFFER_SIZE;
+
+	#ifdef QOP_ZSTD
+		if ((file->flags & QOP_FLAG_COMPRESSED_ZSTD) && !(file->flags & QOP_FLAG_ZSTD_CHUNKED)) {
+			ZSTD_DCtx *dctx = ZSTD_createDCtx();
+			if (
+				!dctx ||
+				((file->flags & QOP_FLAG_ZSTD_DICT) && (
+					!qop->zstd_ddict ||
+					ZSTD_isError(ZSTD_DCtx_refDDict(dctx, (const ZSTD_DDict *)qop->zstd_ddict))
+				))
+			) {
+				ZSTD_freeDCtx(dctx);
+				QOP_FREE(stream->front);
+				stream->front = NULL;
+				return 0;
+			}
+			stream->zstd_dctx = dctx;
+		}
+	#endif
+	#ifdef QOP_IO_URING
+		if (qop_read_is_plain(qop, file)) {
+			qop_uring *ring = (qop_uring *)QOP_MALLOC(sizeof(qop_uring));
+			if (ring && qop_uring_init(ring, 2)) {
+				stream->ring = ring;
+			}
+			else {
+				QOP_FREE(ring);
+			}
+		}
+	#endif
+	return 1;
+}
+
+// Wait for the read into the back buffer. Returns the number of bytes read.
+// If the kernel took the read but it can't be waited for, the back buffer may
+// still be written to: the stream is marked as failed and 0 is returned.
+static qop_uint64_t qop_stream_wait(qop_stream *stream) {
+	qop_uint64_t bytes_read = 0;
+	stream->back_pending = 0;
+	#ifdef QOP_IO_URING
+		qop_uring *ring = (qop_uring *)stream->ring;
+		qop_uint64_t user_data;
+		int res = -1;
+		while (!qop_uring_reap(ring, &user_data, &res)) {
+			if (!qop_uring_enter(ring, 1)) {
+				// A read that was never submitted is done synchronously below
+				if (!qop_uring_unqueue(ring)) {
+					stream->failed = 1;
+					return 0;
+				}
+				break;
+			}
+		}
+		qop_desc *qop = stream->qop;
+		qop_file *file = stream->file;
+		qop_uint64_t len = file->size - stream->back_start;
+		if (len > QOP_STREAM_BUFFER_SIZE) {
+			len = QOP_STREAM_BUFFER_SIZE;
+		}
+		qop_uint64_t offset = qop->files_offset + file->offset + file->path_len + stream->back_start;
+		bytes_read = qop_uring_finish_read(qop, offset, stream->back, len, res);
+	#endif
+	return bytes_read;
+}
+
+// Start reading the part of the file behind the front buffer into the back 
+// buffer, or at least hint the OS to read it ahead.
+static void qop_stream_read_ahead(qop_stream *stream) {
+	qop_desc *qop = stream->qop;
+	qop_file *file = stream->file;
+	qop_uint64_t start = stream->front_start + stream->front_len;
+	if (start >= file->size || !qop_read_is_plain(qop, file)) {
+		return;
+	}
+	qop_uint64_t len = file->size - start;
+	if (len > QOP_STREAM_BUFFER_SIZE) {
+		len = QOP_STREAM_BUFFER_SIZE;
+	}
+	qop_uint64_t offset = qop->files_offset + file->offset + file->path_len + start;
+
+	#ifdef QOP_IO_URING
+		qop_uring *ring = (qop_uring *)stream->ring;
+		if (ring && qop_uring_queue_read(ring, fileno(qop->fh), offset, stream->back, len, 0)) {
+			// Even if submitting failed, the kernel may have taken the read
+			if (qop_uring_enter(ring, 0) || !qop_uring_unqueue(ring)) {
+				stream->back_start = start;
+				stream->back_pending = 1;
+				return;
+			}
+		}
+	#endif
+	qop_prefetch_range(qop, offset, offset + len);
+}
+
+#ifdef QOP_ZSTD
+// Decompress the next len bytes of a compressed, non-chunked file into the 
+// front buffer. The compressed data is read into the back buffer as needed.
+// Returns the number of bytes decompressed.
+static qop_uint64_t qop_stream_decompress(qop_stream *stream, qop_uint64_t len) {
+	qop_desc *qop = stream->qop;
+	qop_file *file = stream->file;
+	ZSTD_outBuffer out = {stream->front, len, 0};
+	while (out.pos < out.size) {
+		if (stream->zstd_in_pos == stream->zstd_in_len) {
+			qop_uint64_t in_len = file->stored_size - stream->zstd_read;
+			if (in_len > QOP_STREAM_BUFFER_SIZE) {
+				in_len = QOP_STREAM_BUFFER_SIZE;
+			}
+			qop_uint64_t offset = qop->files_offset + file->offset + file->path_len + stream->zstd_read;
+			if (in_len == 0 || qop_read_at(qop, offset, stream->back, in_len) != in_len) {
+				break;
+			}
+			stream->zstd_read += in_len;
+			stream->zstd_in_len = in_len;
+			stream->zstd_in_pos = 0;
+		}
+
+		ZSTD_inBuffer in = {stream->back, stream->zstd_in_len, stream->zstd_in_pos};
+		size_t ret = ZSTD_decompressStream((ZSTD_DCtx *)stream->zstd_dctx, &out, &in);
+		stream->zstd_in_pos = in.pos;
+		if (ZSTD_isError(ret) || (ret == 0 && out.pos < out.size)) {
+			break;
+		}
+	}
+	return out.pos;
+}
+#endif
+
+// Fill the front buffer with the part of the file at the current position.
+// Returns 0 on error.
+static int qop_stream_fill(qop_stream *stream) {
+	if (stream->failed) {
+		return 0;
+	}
+	qop_uint64_t start = stream->pos - stream->pos % QOP_STREAM_BUFFER_SIZE;
+	qop_uint64_t len = stream->file->size - start;
+	if (len > QOP_STREAM_BUFFER_SIZE) {
+		len = QOP_STREAM_BUFFER_SIZE;
+	}
+
+	// The position only moves forward, so the streaming context continues 
+	// where the front buffer ends and decompresses any skipped buffers, too
+	#ifdef QOP_ZSTD
+		if (stream->zstd_dctx) {
+			while (1) {
+				qop_uint64_t next = stream->front_start + stream->front_len;
+				qop_uint64_t next_len = stream->file->size - next;
+				if (next_len > QOP_STREAM_BUFFER_SIZE) {
+					next_len = QOP_STREAM_BUFFER_SIZE;
+				}
+				stream->front_start = next;
+				stream->front_len = qop_stream_decompress(stream, next_len);
+				if (stream->front_len != next_len || next_len == 0) {
+					stream->front_len = 0;
+					return 0;
+				}
+				if (next >= start) {
+					return 1;
+				}
+			}
+		}
+	#endif
+
+	if (stream->back_pending) {
+		qop_uint64_t bytes_read = qop_stream_wait(stream);
+		if (stream->failed) {
+			return 0;
+		}
+		if (stream->back_start == start) {
+			unsigned char *front = stream->front;
+			stream->front = stream->back;
+			stream->back = front;
+			stream->front_start = start;
+			stream->front_len = bytes_read;
+			qop_stream_read_ahead(stream);
+			return bytes_read == len;
+		}
+	}
+
+	stream->front_start = start;
+	stream->front_len = qop_read_ex(stream->qop, stream->file, stream->front, start, len);
+	if (stream->front_len != len) {
+		stream->front_len = 0;
+		return 0;
+	}
+	qop_stream_read_ahead(stream);
+	return 1;
+}
+
+unsigned long long qop_stream_read(qop_stream *stream, void *dest, unsigned long long len) {
+	qop_uint64_t size = stream->file->size;
+	if (stream->pos >= size) {
+		return 0;
+	}
+	if (len > size - stream->pos) {
+		len = size - stream->pos;
+	}
+
+	// Mapped and in-memory archives are read directly
+	if (!stream->front) {
+		qop_uint64_t bytes_read = qop_read_ex(stream->qop, stream->file, (unsigned char *)dest, stream->pos, len);
+		stream->pos += bytes_read;
+		return bytes_read;
+	}
+
+	qop_uint64_t bytes_read = 0;
+	while (bytes_read < len) {
+		if (
+			(stream->pos < stream->front_start || stream->pos >= stream->front_start + stream->front_len) &&
+			!qop_stream_fill(stream)
+		) {
+			break;
+		}
+		qop_uint64_t available = stream->front_start + stream->front_len - stream->pos;
+		qop_uint64_t n = len - bytes_read < available ? len - bytes_read : available;
+		memcpy((unsigned char *)dest + bytes_read, stream->front + (stream->pos - stream->front_start), n);
+		bytes_read += n;
+		stream->pos += n;
+	}
+	return bytes_read;
+}
+
+unsigned long long qop_stream_skip(qop_stream *stream, unsigned long long len) {
+	qop_uint64_t size = stream->file->size;
+	if (stream->pos >= size) {
+		return 0;
+	}
+	if (len > size - stream->pos) {
+		len = size - stream->pos;
+	}
+	stream->pos += len;
+	return len;
+}
+
+unsigned long long qop_stream_tell(qop_stream *stream) {
+	return stream->pos;
+}
+
+void qop_stream_close(qop_stream *stream) {
+	if (stream->back_pending) {
+		qop_stream_wait(stream);
+	}
+	#ifdef QOP_IO_URING
+		if (stream->ring) {
+			qop_uring_close((qop_uring *)stream->ring);
+			QOP_FREE(stream->ring);
+		}
+	#endif
+	#ifdef QOP_ZSTD
+		ZSTD_freeDCtx((ZSTD_DCtx *)stream->zstd_dctx);
+		stream->zstd_dctx = NULL;
+	#endif
+	if (!stream->failed) {
+		QOP_FREE(stream->front < stream->back ? stream->front : stream->back);
+	}
+	stream->front = NULL;
+	stream->back = NULL;
+	stream->ring = NULL;
+}
 
 #endif /* QOP_IMPLEMENTATION */
@@ -18,9 +18,19 @@ Command line tool to create and unpack qop archives
 #define QOP_IMPLEMENTATION
 #include "qop.h"
 
+#ifdef QOP_ZSTD
+	#include <zstd.h>
+	#include <zdict.h>
+#endif
+
 #define MAX_PATH_LEN 1024
 #define BUFFER_SIZE 4096
 
+#define CHUNK_SIZE (1024 * 1024)
+#define DICT_SIZE (110 * 1024)
+#define DICT_MAX_FILE_SIZE (64 * 1024)
+#define DICT_MAX_SAMPLES_SIZE (32 * 1024 * 1024)
+
 #define UNUSED(x) (void)(x)
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -90,6 +100,23 @@ typedef struct {
 		UNUSED(mode);
 		return CreateDirectory(path, NULL) ? 0 : -1;
 	}
+
+	int pi_fseek(FILE *fh, qop_uint64_t offset, int origin) {
+		return _fseeki64(fh, offset, origin);
+	}
+
+	qop_uint64_t pi_ftell(FILE *fh) {
+		return _ftelli64(fh);
+	}
+
+	int pi_ftruncate(FILE *fh, qop_uint64_t size) {
+		fflush(fh);
+		return _chsize_s(_fileno(fh), size);
+	}
+
+	int pi_replace(const char *from, const char *to) {
+		return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+	}
 #else
 	#include <dirent.h>
 	
@@ -128,124 +155,407 @@ typedef struct {
 	int pi_mkdir(char *path, int mode) {
 		return mkdir(path, mode);
 	}
+
+	int pi_fseek(FILE *fh, qop_uint64_t offset, int origin) {
+		return fseeko(fh, offset, origin);
+	}
+
+	qop_uint64_t pi_ftell(FILE *fh) {
+		return ftello(fh);
+	}
+
+	int pi_ftruncate(FILE *fh, qop_uint64_t size) {
+		fflush(fh);
+		return ftruncate(fileno(fh), size);
+	}
+
+	// Keep the permissions of the file that is replaced, e.g. for archives 
+	// that are attached to an executable
+	int pi_replace(const char *from, const char *to) {
+		struct stat s;
+		if (stat(to, &s) == 0) {
+			chmod(from, s.st_mode);
+		}
+		return rename(from, to);
+	}
 #endif
 
 
 // -----------------------------------------------------------------------------
-// Unpack
+// Platform specific threads
 
-int create_path(const char *path, const mode_t mode) {
-	char tmp[MAX_PATH_LEN];
-	char *p = NULL;
-	struct stat sb;
-	size_t len;
+#if defined(_WIN32)
+	typedef HANDLE pi_thread;
+	typedef SRWLOCK pi_mutex;
+	typedef CONDITION_VARIABLE pi_cond;
 
-	// copy path
-	len = strnlen(path, MAX_PATH_LEN);
-	if (len == 0 || len == MAX_PATH_LEN) {
-		return -1;
+	typedef struct {
+		void *(*func)(void *);
+		void *arg;
+	} pi_thread_start;
+
+	DWORD WINAPI pi_thread_main(LPVOID param) {
+		pi_thread_start start = *(pi_thread_start *)param;
+		free(param);
+		start.func(start.arg);
+		return 0;
+	}
+
+	int pi_thread_create(pi_thread *thread, void *(*func)(void *), void *arg) {
+		pi_thread_start *start = malloc(sizeof(pi_thread_start));
+		start->func = func;
+		start->arg = arg;
+		*thread = CreateThread(NULL, 0, pi_thread_main, start, 0, NULL);
+		return *thread ? 0 : -1;
+	}
+
+	void pi_thread_join(pi_thread thread) {
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+
+	void pi_mutex_init(pi_mutex *m) { InitializeSRWLock(m); }
+	void pi_mutex_destroy(pi_mutex *m) { UNUSED(m); }
+	void pi_mutex_lock(pi_mutex *m) { AcquireSRWLockExclusive(m); }
+	void pi_mutex_unlock(pi_mutex *m) { ReleaseSRWLockExclusive(m); }
+	void pi_cond_init(pi_cond *c) { InitializeConditionVariable(c); }
+	void pi_cond_destroy(pi_cond *c) { UNUSED(c); }
+	void pi_cond_wait(pi_cond *c, pi_mutex *m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+	void pi_cond_broadcast(pi_cond *c) { WakeAllConditionVariable(c); }
+#else
+	#include <pthread.h>
+
+	typedef pthread_t pi_thread;
+	typedef pthread_mutex_t pi_mutex;
+	typedef pthread_cond_t pi_cond;
+
+	int pi_thread_create(pi_thread *thread, void *(*func)(void *), void *arg) {
+		return pthread_create(thread, NULL, func, arg);
+	}
+
+	void pi_thread_join(pi_thread thread) {
+		pthread_join(thread, NULL);
 	}
-	memcpy(tmp, path, len);
-	tmp[len] = '\0';
 
-	// remove file part
-	char *last_slash = strrchr(tmp, '/');
-	if (last_slash == NULL) {
+	void pi_mutex_init(pi_mutex *m) { pthread_mutex_init(m, NULL); }
+	void pi_mutex_destroy(pi_mutex *m) { pthread_mutex_destroy(m); }
+	void pi_mutex_lock(pi_mutex *m) { pthread_mutex_lock(m); }
+	void pi_mutex_unlock(pi_mutex *m) { pthread_mutex_unlock(m); }
+	void pi_cond_init(pi_cond *c) { pthread_cond_init(c, NULL); }
+	void pi_cond_destroy(pi_cond *c) { pthread_cond_destroy(c); }
+	void pi_cond_wait(pi_cond *c, pi_mutex *m) { pthread_cond_wait(c, m); }
+	void pi_cond_broadcast(pi_cond *c) { pthread_cond_broadcast(c); }
+#endif
+
+
+// -----------------------------------------------------------------------------
+// Unpack
+
+int create_dir(const char *path, const mode_t mode) {
+	if (pi_mkdir((char *)path, mode) == 0) {
 		return 0;
 	}
-	*last_slash = '\0';
+	struct stat sb;
+	return stat(path, &sb) == 0 && S_ISDIR(sb.st_mode) ? 0 : -1;
+}
+
+int compare_strings(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-	// check if path exists and is a directory
-	if (stat(tmp, &sb) == 0) {
-		if (S_ISDIR(sb.st_mode)) {
-			return 0;
+// Create all directories needed for the given paths. Each directory is 
+// created only once; parents are created before their children.
+void create_dirs(char **paths, int paths_len, const mode_t mode) {
+	int dirs_len = 0;
+	int dirs_capacity = 1024;
+	char **dirs = malloc(dirs_capacity * sizeof(char *));
+	const char *prev = NULL;
+	int prev_dir_len = 0;
+
+	for (int i = 0; i < paths_len; i++) {
+		const char *path = paths[i];
+		const char *last_slash = strrchr(path, '/');
+		int dir_len = last_slash ? last_slash - path : 0;
+
+		// Files are usually grouped by directory; skip if it's the same as the
+		// previous one
+		if (
+			dir_len == 0 || 
+			(prev && dir_len == prev_dir_len && memcmp(path, prev, dir_len) == 0)
+		) {
+			continue;
 		}
-	}
+		prev = path;
+		prev_dir_len = dir_len;
 
-	// recursive mkdir
-	for (p = tmp + 1; *p; p++) {
-		if (*p == '/') {
-			*p = 0;
-			if (stat(tmp, &sb) != 0) {
-				if (pi_mkdir(tmp, mode) < 0) {
-					return -1;
-				}
+		for (int j = 1; j <= dir_len; j++) {
+			if (j != dir_len && path[j] != '/') {
+				continue;
 			}
-			else if (!S_ISDIR(sb.st_mode)) {
-				return -1;
+			if (dirs_len >= dirs_capacity) {
+				dirs_capacity *= 2;
+				dirs = realloc(dirs, dirs_capacity * sizeof(char *));
 			}
-			*p = '/';
+			dirs[dirs_len] = malloc(j + 1);
+			memcpy(dirs[dirs_len], path, j);
+			dirs[dirs_len][j] = '\0';
+			dirs_len++;
 		}
 	}
-	if (stat(tmp, &sb) != 0) {
-		if (pi_mkdir(tmp, mode) < 0) {
-			return -1;
+
+	// A path sorts before all paths it is a prefix of
+	qsort(dirs, dirs_len, sizeof(char *), compare_strings);
+	for (int i = 0; i < dirs_len; i++) {
+		if (i == 0 || strcmp(dirs[i], dirs[i-1]) != 0) {
+			error_if(create_dir(dirs[i], mode) != 0, "Could not create path %s", dirs[i]);
 		}
 	}
-	else if (!S_ISDIR(sb.st_mode)) {
-		return -1;
+	for (int i = 0; i < dirs_len; i++) {
+		free(dirs[i]);
 	}
-	return 0;
+	free(dirs);
 }
 
-unsigned int copy_out(FILE *src, unsigned int offset, unsigned int size, const char *dest_path) {
+// Write the contents of a file in the archive to dest_path. Files that were
+// compressed as a whole are decompressed into memory; all others are copied
+// in pieces through positional reads, so this can be called from any thread.
+void extract_file(qop_desc *qop, qop_file *file, const char *dest_path) {
+	#ifndef QOP_ZSTD
+		error_if(file->flags & QOP_FLAG_COMPRESSED_ZSTD, "File %s is compressed, but qopconv was built without zstd support", dest_path);
+	#endif
+
 	FILE *dest = fopen(dest_path, "wb");
 	error_if(!dest, "Could not open file %s for writing", dest_path);
 
-	char buffer[BUFFER_SIZE];
-	size_t bytes_read, bytes_written;
-	unsigned int bytes_total = 0;
-	unsigned int read_size = size < BUFFER_SIZE ? size : BUFFER_SIZE;
-
-	fseek(src, offset, SEEK_SET);
-	while (read_size > 0 && (bytes_read = fread(buffer, 1, read_size, src)) > 0) {
-		bytes_written = fwrite(buffer, 1, bytes_read, dest);
-		error_if(bytes_written != bytes_read, "Write error");
-		bytes_total += bytes_written;
-		if (bytes_total >= size) {
-			break;
-		}
-		if (size - bytes_total < read_size) {
-			read_size = size - bytes_total;
+	if (
+		(file->flags & QOP_FLAG_COMPRESSED_ZSTD) && 
+		!(file->flags & QOP_FLAG_ZSTD_CHUNKED)
+	) {
+		unsigned char *contents = malloc(file->size);
+		error_if(qop_read(qop, file, contents) != file->size, "Could not decompress %s", dest_path);
+		error_if(fwrite(contents, 1, file->size, dest) != file->size, "Write error");
+		free(contents);
+	}
+	else {
+		unsigned int buffer_size = file->size < CHUNK_SIZE ? file->size : CHUNK_SIZE;
+		unsigned char *buffer = malloc(buffer_size ? buffer_size : 1);
+		for (qop_uint64_t pos = 0; pos < file->size; pos += buffer_size) {
+			unsigned int len = file->size - pos < buffer_size ? file->size - pos : buffer_size;
+			error_if(qop_read_ex(qop, file, buffer, pos, len) != len, "read error for file %s", dest_path);
+			error_if(fwrite(buffer, 1, len, dest) != len, "Write error");
 		}
+		free(buffer);
 	}
-
-	error_if(ferror(src), "read error for file %s", dest_path);
 	fclose(dest);
-	return bytes_total;
 }
 
-void unpack(const char *archive_path, int list_only) {
+typedef struct {
+	qop_desc *qop;
+	qop_file **files;
+	char **paths;
+	int len;
+	int next;
+	pi_mutex mutex;
+} unpack_queue;
+
+void *unpack_worker(void *arg) {
+	unpack_queue *q = arg;
+	while (1) {
+		pi_mutex_lock(&q->mutex);
+		int i = q->next++;
+		pi_mutex_unlock(&q->mutex);
+		if (i >= q->len) {
+			break;
+		}
+		extract_file(q->qop, q->files[i], q->paths[i]);
+	}
+	return NULL;
+}
+
+void unpack(const char *archive_path, int list_only, int jobs) {
 	qop_desc qop;
-	int archive_size = qop_open(archive_path, &qop);
+	qop_uint64_t archive_size = qop_open(archive_path, &qop);
 	error_if(archive_size == 0, "Could not open archive %s", archive_path);
 
 	// Read the archive index
-	int index_len = qop_read_index(&qop, malloc(qop.hashmap_size));
+	void *hashmap = malloc(qop.hashmap_size);
+	int index_len = qop_read_index(&qop, hashmap);
 	error_if(index_len == 0, "Could not read index from archive %s", archive_path);
-	
-	// Extract all files
+
+	// Read the path table, if present
+	void *paths = malloc(qop.paths_size);
+	qop_read_paths(&qop, paths);
+
+	// Collect all files
+	unpack_queue q = {
+		.qop = &qop,
+		.files = malloc(index_len * sizeof(qop_file *)),
+		.paths = malloc(index_len * sizeof(char *)),
+		.len = 0,
+		.next = 0
+	};
 	for (unsigned int i = 0; i < qop.hashmap_len; i++) {
 		qop_file *file = &qop.hashmap[i];
 		if (file->size == 0) {
 			continue;
 		}
 		error_if(file->path_len >= MAX_PATH_LEN, "Path for file %016llx exceeds %d", file->hash, MAX_PATH_LEN);
-		char path[MAX_PATH_LEN];
-		qop_read_path(&qop, file, path);
+		char *path = malloc(file->path_len);
+		error_if(!qop_read_path(&qop, file, path), "Could not read path for file %016llx", file->hash);
 
 		// Integrity check
 		// error_if(!qop_find(&qop, path), "could not find %s", path);
 
-		printf("%6d %016llx %10d %s\n", i, file->hash, file->size, path);
+		printf("%6d %016llx %10llu %s\n", i, file->hash, file->size, path);
+		q.files[q.len] = file;
+		q.paths[q.len] = path;
+		q.len++;
+	}
 
-		if (!list_only) {
-			error_if(create_path(path, 0755) != 0, "Could not create path %s", path);
-			copy_out(qop.fh, qop.files_offset + file->offset + file->path_len, file->size, path);
+	// Extract all files
+	if (!list_only) {
+		create_dirs(q.paths, q.len, 0755);
+		if (jobs <= 1) {
+			for (int i = 0; i < q.len; i++) {
+				extract_file(&qop, q.files[i], q.paths[i]);
+			}
+		}
+		else {
+			pi_mutex_init(&q.mutex);
+			pi_thread *threads = malloc(jobs * sizeof(pi_thread));
+			for (int i = 0; i < jobs; i++) {
+				error_if(pi_thread_create(&threads[i], unpack_worker, &q) != 0, "Could not create thread");
+			}
+			for (int i = 0; i < jobs; i++) {
+				pi_thread_join(threads[i]);
+			}
+			free(threads);
+			pi_mutex_destroy(&q.mutex);
 		}
 	}
 
-	free(qop.hashmap);
+	for (int i = 0; i < q.len; i++) {
+		free(q.paths[i]);
+	}
+	free(q.paths);
+	free(q.files);
+	free(paths);
+	qop_close(&qop);
+	free(hashmap);
+}
+
+
+// -----------------------------------------------------------------------------
+// Stats
+
+void print_stats(const char *archive_path) {
+	qop_desc qop;
+	qop_uint64_t archive_size = qop_open(archive_path, &qop);
+	error_if(archive_size == 0, "Could not open archive %s", archive_path);
+
+	void *hashmap = malloc(qop.hashmap_size);
+	int index_len = qop_read_index(&qop, hashmap);
+	error_if(index_len == 0, "Could not read index from archive %s", archive_path);
+	void *paths = malloc(qop.paths_size);
+	qop_read_paths(&qop, paths);
+
+	unsigned int index_size = qop.version == 2 ? QOP_INDEX_SIZE_V2 : QOP_INDEX_SIZE;
+	printf("archive:        %s\n", archive_path);
+	printf("version:        %u\n", qop.version);
+	printf("hash:           %s\n", qop.hash_type == QOP_HASH_WORD64 ? "word64" : "murmur");
+	printf("size:           %llu bytes\n", archive_size);
+	printf("files:          %u\n", qop.index_len);
+	printf("index:          %llu bytes\n", (qop_uint64_t)qop.index_len * index_size);
+
+	const char *section_names[QOP_SECTION_MAX] = {
+		[QOP_SECTION_HASHMAP] = "hashmap",
+		[QOP_SECTION_PATHS] = "paths",
+		[QOP_SECTION_SIZES] = "sizes",
+		[QOP_SECTION_ZSTD_DICT] = "zstd dict",
+		[QOP_SECTION_SORTED_PATHS] = "sorted paths",
+		[QOP_SECTION_ALIGN] = "align"
+	};
+	for (int i = 0; i < QOP_SECTION_MAX; i++) {
+		if (qop.sections[i].size) {
+			printf("section:        %s, %llu bytes\n", 
+				section_names[i] ? section_names[i] : "unknown", qop.sections[i].size);
+		}
+	}
+
+	// The compact index has no hashmap slots to analyze
+	#ifdef QOP_COMPACT_INDEX
+		printf("compact index:  %u groups, %llu bytes in memory\n", qop.index_groups_len, qop.hashmap_size);
+	#else
+		// The probe length of a file is the number of slots qop_find() visits to
+		// find it: the distance from its home slot + 1. A miss visits all slots up 
+		// to the next empty one. Empty files have no slot and are not counted.
+		unsigned int mask = qop.hashmap_len - 1;
+		unsigned int files = 0;
+		unsigned int max_probe = 0;
+		unsigned int *histogram = calloc(qop.hashmap_len + 1, sizeof(unsigned int));
+		qop_uint64_t total_probes = 0;
+		qop_uint64_t total_miss_probes = 0;
+		for (unsigned int i = 0; i < qop.hashmap_len; i++) {
+			qop_file *file = &qop.hashmap[i];
+			if (file->size == 0) {
+				continue;
+			}
+			unsigned int probe = ((i - (unsigned int)file->hash) & mask) + 1;
+			histogram[probe]++;
+			files++;
+			total_probes += probe;
+			if (probe > max_probe) {
+				max_probe = probe;
+			}
+		}
+
+		// Walk the slots backwards from an empty one, so that the length of the 
+		// run of occupied slots in front of each slot is known
+		unsigned int empty = 0;
+		while (qop.hashmap[empty].size) {
+			empty++;
+		}
+		unsigned int run = 0;
+		for (unsigned int n = 0, i = empty; n < qop.hashmap_len; n++, i = (i - 1) & mask) {
+			run = qop.hashmap[i].size ? run + 1 : 0;
+			total_miss_probes += run + 1;
+		}
+
+		printf("hashmap:        %u slots, %llu bytes in memory, load factor %.3f\n", 
+			qop.hashmap_len, (qop_uint64_t)qop.hashmap_len * sizeof(qop_file), 
+			(double)files / qop.hashmap_len);
+		printf("probes:         %.3f average, %u max, %.3f average for misses\n",
+			files ? (double)total_probes / files : 0, max_probe, 
+			(double)total_miss_probes / qop.hashmap_len);
+		printf("\nprobe length histogram:\n");
+		for (unsigned int i = 1; i <= max_probe; i++) {
+			if (histogram[i]) {
+				printf("%6u %8u %6.2f%%\n", i, histogram[i], histogram[i] * 100.0 / files);
+			}
+		}
+		free(histogram);
+	#endif
+
+	#ifdef QOP_STATS
+		// Look up every file once and show what the library counted
+		char path[MAX_PATH_LEN];
+		for (unsigned int i = 0; i < qop.hashmap_len; i++) {
+			qop_file *file = &qop.hashmap[i];
+			if (file->size && file->path_len < MAX_PATH_LEN && qop_read_path(&qop, file, path)) {
+				qop_find(&qop, path);
+			}
+		}
+		qop_stats *s = &qop.stats;
+		printf("\nQOP_STATS after opening and finding every file:\n");
+		printf("finds:          %llu, %.3f average probes, %u max\n", 
+			s->finds, s->finds ? (double)s->find_probes / s->finds : 0, s->find_max_probe);
+		printf("inserts:        %llu, %.3f average probes, %u max\n", 
+			s->inserts, s->inserts ? (double)s->insert_probes / s->inserts : 0, s->insert_max_probe);
+		printf("reads:          %llu, %llu bytes\n", s->reads, s->bytes_read);
+	#endif
+
+	free(paths);
+	free(hashmap);
 	qop_close(&qop);
 }
 
@@ -253,11 +563,90 @@ void unpack(const char *archive_path, int list_only) {
 // -----------------------------------------------------------------------------
 // Pack
 
+typedef struct {
+	int write_hashmap;
+	int write_paths;
+	int write_sorted;
+	int zstd_level;
+	int zstd_dict;
+	unsigned int chunk_size;
+	int jobs;
+	int force_v2;
+	unsigned int align;
+	int dedup;
+	unsigned int hash_type;
+	const char *order_path;
+	int write_checksums;
+} pack_options;
+
+typedef struct {
+	char **paths;
+	qop_uint64_t *sizes;
+	int len;
+	int capacity;
+} path_list;
+
+// A unit of work for the pack pipeline: a whole file, or one chunk of a file
+// that is larger than the chunk size
+typedef struct {
+	int file;
+	unsigned int chunk;
+	unsigned int chunks_len;
+	qop_uint64_t offset;
+	unsigned int len;
+} pack_item;
+
+// The bytes to be stored for a pack_item. With checksums, the checksum of 
+// single item files is computed by the worker; for files with more items the
+// writer needs the uncompressed bytes (raw) of each item in order.
+typedef struct {
+	unsigned char *data;
+	unsigned char *raw;
+	unsigned int len;
+	unsigned int raw_len;
+	unsigned short flags;
+	qop_uint64_t content_hash;
+	qop_uint64_t checksum;
+	int ready;
+} pack_result;
+
+typedef struct {
+	unsigned int type;
+	qop_uint64_t offset;
+	qop_uint64_t size;
+} pack_section;
+
 typedef struct {
 	qop_file *files;
+	int *sources;
+	qop_uint64_t *content_hashes;
 	int len;
 	int capacity;
-	int size;
+	qop_uint64_t size;
+	unsigned int version;
+	unsigned int hash_type;
+	char *paths;
+	unsigned int paths_len;
+	unsigned int paths_capacity;
+	int has_compressed;
+	unsigned char *dict;
+	unsigned int dict_size;
+	#ifdef QOP_ZSTD
+		ZSTD_CDict *cdict;
+	#endif
+	qop_file current;
+	int current_is_shared;
+	qop_uint64_t current_content_hash;
+	qop_checksum_state current_checksum;
+	int *dedup_map;
+	unsigned int dedup_map_len;
+	int dedup_len;
+	qop_uint64_t dedup_saved;
+	qop_uint64_t frames_table_pos;
+	qop_uint64_t *frame_offsets;
+	const pack_options *options;
+	pack_section sections[QOP_SECTION_MAX];
+	int sections_len;
 } pack_state;
 
 void write_16(unsigned int v, FILE *fh) {
@@ -292,57 +681,622 @@ void write_64(qop_uint64_t v, FILE *fh) {
 	error_if(!written, "Write error");
 }
 
-unsigned int copy_into(const char *src_path, FILE *dest) {
-	FILE *src = fopen(src_path, "rb");
-	error_if(!src, "Could not open file %s for reading", src_path);
+void write_padding(unsigned int align, FILE *fh, pack_state *state) {
+	while (state->size % align) {
+		error_if(fputc(0, fh) == EOF, "Write error");
+		state->size++;
+	}
+}
 
-	char buffer[BUFFER_SIZE];
-	size_t bytes_read, bytes_written;
-	unsigned int bytes_total = 0;
+void begin_section(unsigned int type, FILE *fh, pack_state *state) {
+	write_padding(8, fh, state);
+	state->sections[state->sections_len] = (pack_section){
+		.type = type,
+		.offset = state->size,
+		.size = 0
+	};
+}
+
+void end_section(pack_state *state) {
+	pack_section *section = &state->sections[state->sections_len];
+	section->size = state->size - section->offset;
+	state->sections_len++;
+}
 
-	while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, src)) > 0) {
-		bytes_written = fwrite(buffer, 1, bytes_read, dest);
-		error_if(bytes_written != bytes_read, "Write error");
-		bytes_total += bytes_written;
+void write_hashmap(FILE *dest, pack_state *state) {
+	unsigned int hashmap_len = qop_hashmap_len_for(state->len);
+	qop_file *hashmap = calloc(hashmap_len, sizeof(qop_file));
+	for (int i = 0; i < state->len; i++) {
+		qop_hashmap_insert(hashmap, hashmap_len - 1, &state->files[i]);
 	}
 
-	error_if(ferror(src), "read error for file %s", src_path);
-	fclose(src);
-	return bytes_total;
+	begin_section(QOP_SECTION_HASHMAP, dest, state);
+	write_32(hashmap_len, dest);
+	write_32(QOP_HASHMAP_SLOT_SIZE, dest);
+	for (unsigned int i = 0; i < hashmap_len; i++) {
+		write_64(hashmap[i].hash, dest);
+		write_64(hashmap[i].offset, dest);
+		write_64(hashmap[i].size, dest);
+		write_64(hashmap[i].stored_size, dest);
+		write_32(hashmap[i].path_offset, dest);
+		write_16(hashmap[i].path_len, dest);
+		write_16(hashmap[i].flags, dest);
+	}
+	state->size += QOP_HASHMAP_HEADER_SIZE + (qop_uint64_t)hashmap_len * QOP_HASHMAP_SLOT_SIZE;
+	end_section(state);
+	free(hashmap);
 }
 
-void add_file(const char *path, FILE *dest, pack_state *state) {
-	if (state->len >= state->capacity) {
-		state->capacity *= 2;
-		state->files = realloc(state->files, state->capacity * sizeof(qop_file));
+void write_paths(FILE *dest, pack_state *state) {
+	begin_section(QOP_SECTION_PATHS, dest, state);
+	int written = fwrite(state->paths, 1, state->paths_len, dest);
+	error_if(written != (int)state->paths_len, "Write error");
+	state->size += state->paths_len;
+	end_section(state);
+}
+
+void write_sorted_paths(FILE *dest, pack_state *state) {
+	const char **sorted = malloc(state->len * sizeof(char *));
+	for (int i = 0; i < state->len; i++) {
+		sorted[i] = state->paths + state->files[i].path_offset;
 	}
+	qsort(sorted, state->len, sizeof(char *), compare_strings);
 
-	qop_uint64_t hash = qop_hash(path);
-	
+	begin_section(QOP_SECTION_SORTED_PATHS, dest, state);
+	for (int i = 0; i < state->len; i++) {
+		write_32(sorted[i] - state->paths, dest);
+	}
+	state->size += state->len * 4;
+	end_section(state);
+	free(sorted);
+}
 
-	// Write the path into the archive
-	int path_len = strlen(path) + 1;
-	int path_written = fwrite(path, sizeof(char), path_len, dest);
-	error_if(path_written != path_len, "Write error");
+void write_sizes(FILE *dest, pack_state *state) {
+	begin_section(QOP_SECTION_SIZES, dest, state);
+	for (int i = 0; i < state->len; i++) {
+		if (state->version == 2) {
+			write_64(state->files[i].size, dest);
+		}
+		else {
+			write_32(state->files[i].size, dest);
+		}
+	}
+	state->size += state->len * (state->version == 2 ? 8 : 4);
+	end_section(state);
+}
 
-	// Copy the file into the archive
-	unsigned int size = copy_into(path, dest);
+void write_dict(FILE *dest, pack_state *state) {
+	begin_section(QOP_SECTION_ZSTD_DICT, dest, state);
+	int written = fwrite(state->dict, 1, state->dict_size, dest);
+	error_if(written != (int)state->dict_size, "Write error");
+	state->size += state->dict_size;
+	end_section(state);
+}
 
-	printf("%6d %016llx %10d %s\n", state->len, hash, size, path);
+void write_align(FILE *dest, pack_state *state) {
+	begin_section(QOP_SECTION_ALIGN, dest, state);
+	write_32(state->options->align, dest);
+	state->size += 4;
+	end_section(state);
+}
 
-	// Collect file info for the index
-	state->files[state->len] = (qop_file){
-		.hash = hash,
-		.offset = state->size,
-		.size = size,
-		.path_len = path_len,
-		.flags = QOP_FLAG_NONE
+void write_sections(FILE *dest, pack_state *state) {
+	if (state->sections_len == 0) {
+		return;
+	}
+	for (int i = 0; i < state->sections_len; i++) {
+		write_32(state->sections[i].type, dest);
+		write_64(state->sections[i].offset, dest);
+		write_64(state->sections[i].size, dest);
+	}
+	write_32(state->sections_len, dest);
+	write_32(QOP_SECTIONS_MAGIC, dest);
+	state->size += state->sections_len * QOP_SECTION_SIZE + 8;
+}
+
+// Hash of the contents of a file, 8 bytes at a time. This is only used to find
+// candidates for deduplication; equal contents are always verified.
+qop_uint64_t content_hash(const unsigned char *data, unsigned int len) {
+	qop_uint64_t h = 525201411107845655ull ^ len;
+	unsigned int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		qop_uint64_t k;
+		memcpy(&k, data + i, 8);
+		k *= 0x87c37b91114253d5ull;
+		k ^= k >> 31;
+		h = (h ^ k) * 0x5bd1e9955bd1e995ull;
+		h ^= h >> 47;
+	}
+	for (; i < len; i++) {
+		h = (h ^ data[i]) * 0x5bd1e9955bd1e995ull;
+		h ^= h >> 47;
+	}
+	return h;
+}
+
+int files_equal(const char *path_a, const char *path_b) {
+	FILE *a = fopen(path_a, "rb");
+	FILE *b = fopen(path_b, "rb");
+	error_if(!a, "Could not open file %s for reading", path_a);
+	error_if(!b, "Could not open file %s for reading", path_b);
+
+	static unsigned char buffer_a[BUFFER_SIZE * 16], buffer_b[BUFFER_SIZE * 16];
+	int equal = 1;
+	size_t len_a, len_b;
+	do {
+		len_a = fread(buffer_a, 1, sizeof(buffer_a), a);
+		len_b = fread(buffer_b, 1, sizeof(buffer_b), b);
+		equal = len_a == len_b && memcmp(buffer_a, buffer_b, len_a) == 0;
+	} while (equal && len_a > 0);
+
+	fclose(a);
+	fclose(b);
+	return equal;
+}
+
+// Find an earlier file with the same contents as the file of this item. 
+// Returns the index into state->files or -1.
+int find_shared(pack_state *state, path_list *list, pack_item *item, qop_uint64_t hash) {
+	if (!state->dedup_map_len) {
+		return -1;
+	}
+	unsigned int mask = state->dedup_map_len - 1;
+	for (unsigned int idx = hash & mask; state->dedup_map[idx] >= 0; idx = (idx + 1) & mask) {
+		int i = state->dedup_map[idx];
+		if (
+			state->content_hashes[i] == hash &&
+			state->files[i].size == list->sizes[item->file] &&
+			files_equal(list->paths[state->sources[i]], list->paths[item->file])
+		) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void dedup_map_insert(pack_state *state, int file) {
+	unsigned int mask = state->dedup_map_len - 1;
+	unsigned int idx = state->content_hashes[file] & mask;
+	while (state->dedup_map[idx] >= 0) {
+		idx = (idx + 1) & mask;
+	}
+	state->dedup_map[idx] = file;
+}
+
+// Make the contents of a file available for deduplication. The map is kept 
+// at most half full and rebuilt with twice the size when needed.
+void add_shared(pack_state *state, int file) {
+	state->dedup_len++;
+	if ((unsigned int)state->dedup_len * 2 > state->dedup_map_len) {
+		free(state->dedup_map);
+		state->dedup_map_len = state->dedup_map_len ? state->dedup_map_len * 2 : 1024;
+		state->dedup_map = malloc(state->dedup_map_len * sizeof(int));
+		memset(state->dedup_map, 0xff, state->dedup_map_len * sizeof(int));
+		for (int i = 0; i < file; i++) {
+			if (
+				state->sources[i] >= 0 &&
+				state->files[i].size > 0 &&
+				!(state->files[i].flags & QOP_FLAG_SHARED_DATA)
+			) {
+				dedup_map_insert(state, i);
+			}
+		}
+	}
+	dedup_map_insert(state, file);
+}
+
+// Read (and compress) the bytes of one pack item. This is called from the 
+// worker threads. Each thread has its own compression context.
+void process_item(pack_state *state, path_list *list, pack_item *item, void *cctx, pack_result *result) {
+	const char *path = list->paths[item->file];
+	unsigned char *contents = malloc(item->len ? item->len : 1);
+	if (item->len) {
+		FILE *src = fopen(path, "rb");
+		error_if(!src, "Could not open file %s for reading", path);
+		error_if(pi_fseek(src, item->offset, SEEK_SET) != 0, "Could not seek in file %s", path);
+		size_t bytes_read = fread(contents, 1, item->len, src);
+		error_if(bytes_read != item->len, "read error for file %s (file changed while packing?)", path);
+		fclose(src);
+	}
+
+	int keep_raw = state->options->write_checksums && item->chunks_len > 1;
+	result->data = contents;
+	result->raw = keep_raw ? contents : NULL;
+	result->len = item->len;
+	result->raw_len = item->len;
+	result->flags = QOP_FLAG_NONE;
+	result->content_hash = state->options->dedup ? content_hash(contents, item->len) : 0;
+	result->checksum = state->options->write_checksums && item->chunks_len == 1
+		? qop_checksum(contents, item->len)
+		: 0;
+	if (!state->options->zstd_level) {
+		UNUSED(cctx);
+		return;
+	}
+
+	#ifdef QOP_ZSTD
+		size_t bound = ZSTD_compressBound(item->len);
+		unsigned char *compressed = malloc(bound);
+		unsigned short compressed_flags = QOP_FLAG_COMPRESSED_ZSTD;
+		size_t compressed_size;
+		if (state->cdict && item->chunks_len == 1 && item->len <= DICT_MAX_FILE_SIZE) {
+			compressed_size = ZSTD_compress_usingCDict(cctx, compressed, bound, contents, item->len, state->cdict);
+			compressed_flags |= QOP_FLAG_ZSTD_DICT;
+		}
+		else {
+			compressed_size = ZSTD_compressCCtx(cctx, compressed, bound, contents, item->len, state->options->zstd_level);
+		}
+		error_if(ZSTD_isError(compressed_size), "Could not compress %s: %s", path, ZSTD_getErrorName(compressed_size));
+
+		// Only keep the compressed data if it's actually smaller
+		if (compressed_size < item->len) {
+			if (!keep_raw) {
+				free(contents);
+			}
+			result->data = compressed;
+			result->len = compressed_size;
+			result->flags = compressed_flags;
+		}
+		else {
+			free(compressed);
+		}
+	#endif
+}
+
+void free_result(pack_result *result) {
+	if (result->raw != result->data) {
+		free(result->raw);
+	}
+	free(result->data);
+}
+
+// Write the result of one pack item to the archive. This is called for all
+// items in order, so the output does not depend on the number of threads.
+void write_item(pack_state *state, path_list *list, pack_item *item, pack_result *result, FILE *dest) {
+	const char *path = list->paths[item->file];
+	qop_file *file = &state->current;
+	int chunked = state->options->zstd_level && item->chunks_len > 1;
+
+	// First item of a file: write the path and reserve the frame table
+	if (item->chunk == 0) {
+		if (state->len >= state->capacity) {
+			state->capacity *= 2;
+			state->files = realloc(state->files, state->capacity * sizeof(qop_file));
+			state->sources = realloc(state->sources, state->capacity * sizeof(int));
+			state->content_hashes = realloc(state->content_hashes, state->capacity * sizeof(qop_uint64_t));
+		}
+
+		// Look for an earlier file with the same contents. The shared data must
+		// be far enough into the archive to be addressed as offset + path_len.
+		int path_len = strlen(path) + 1;
+		int shared = -1;
+		if (state->options->dedup && list->sizes[item->file] > 0) {
+			shared = find_shared(state, list, item, result->content_hash);
+			if (shared >= 0 && state->files[shared].offset + state->files[shared].path_len < (qop_uint64_t)path_len) {
+				shared = -1;
+			}
+		}
+		state->current_is_shared = shared >= 0;
+		state->current_content_hash = result->content_hash;
+		qop_checksum_init(&state->current_checksum);
+
+		// Pad in front of the path, so that the data starts at an aligned 
+		// offset. Readers never look at the bytes between files.
+		if (!state->current_is_shared) {
+			while ((state->size + path_len) % state->options->align) {
+				error_if(fputc(0, dest) == EOF, "Write error");
+				state->size++;
+			}
+
+			int path_written = fwrite(path, sizeof(char), path_len, dest);
+			error_if(path_written != path_len, "Write error");
+		}
+
+		// Keep the path for the path table
+		if (state->paths_len + path_len > state->paths_capacity) {
+			state->paths_capacity = (state->paths_len + path_len) * 2;
+			state->paths = realloc(state->paths, state->paths_capacity);
+		}
+		memcpy(state->paths + state->paths_len, path, path_len);
+
+		*file = (qop_file){
+			.hash = qop_hash_path(state->hash_type, path),
+			.offset = state->size,
+			.size = list->sizes[item->file],
+			.path_len = path_len,
+			.flags = QOP_FLAG_NONE,
+			.path_offset = state->paths_len,
+			.stored_size = 0
+		};
+		state->paths_len += path_len;
+
+		if (state->current_is_shared) {
+			qop_file *original = &state->files[shared];
+			file->offset = original->offset + original->path_len - path_len;
+			file->flags = original->flags | QOP_FLAG_SHARED_DATA;
+			file->stored_size = original->stored_size;
+		}
+		else {
+			state->size += path_len;
+		}
+
+		if (chunked && !state->current_is_shared) {
+			file->flags = QOP_FLAG_COMPRESSED_ZSTD | QOP_FLAG_ZSTD_CHUNKED;
+			state->frame_offsets = realloc(state->frame_offsets, (item->chunks_len + 1) * sizeof(qop_uint64_t));
+			state->frames_table_pos = pi_ftell(dest);
+			write_32(state->options->chunk_size, dest);
+			for (unsigned int i = 0; i < item->chunks_len + 1; i++) {
+				write_64(0, dest);
+			}
+			file->stored_size = 4 + (item->chunks_len + 1) * 8;
+		}
+	}
+
+	if (!state->current_is_shared) {
+		if (chunked) {
+			state->frame_offsets[item->chunk] = file->stored_size;
+		}
+		else if (item->chunks_len == 1) {
+			file->flags = result->flags;
+		}
+		error_if(fwrite(result->data, 1, result->len, dest) != result->len, "Write error");
+		file->stored_size += result->len;
+		if (result->raw) {
+			qop_checksum_update(&state->current_checksum, result->raw, result->raw_len);
+		}
+	}
+
+	// Last item of a file: write the frame table and collect the file info
+	if (item->chunk == item->chunks_len - 1) {
+		if (chunked && !state->current_is_shared) {
+			state->frame_offsets[item->chunks_len] = file->stored_size;
+			pi_fseek(dest, state->frames_table_pos + 4, SEEK_SET);
+			for (unsigned int i = 0; i < item->chunks_len + 1; i++) {
+				write_64(state->frame_offsets[i], dest);
+			}
+			pi_fseek(dest, 0, SEEK_END);
+		}
+
+		// The checksum follows the stored bytes, but is not part of them
+		if (state->options->write_checksums && !state->current_is_shared) {
+			write_64(item->chunks_len == 1 ? result->checksum : qop_checksum_final(&state->current_checksum), dest);
+			file->flags |= QOP_FLAG_CHECKSUM;
+			state->size += 8;
+		}
+
+		printf("%6d %016llx %10llu %s\n", state->len, file->hash, file->size, path);
+		state->has_compressed |= file->flags;
+		state->files[state->len] = *file;
+		state->sources[state->len] = item->file;
+		state->content_hashes[state->len] = state->current_content_hash;
+		state->len++;
+
+		if (state->current_is_shared) {
+			state->dedup_saved += file->stored_size + file->path_len;
+		}
+		else {
+			state->size += file->stored_size;
+			if (state->options->dedup && file->size > 0) {
+				add_shared(state, state->len - 1);
+			}
+		}
+	}
+}
+
+// Train a zstd dictionary on the small files of the list and create the 
+// compression dictionary from it
+void train_dict(path_list *list, pack_state *state) {
+	#ifdef QOP_ZSTD
+		unsigned char *samples = malloc(DICT_MAX_SAMPLES_SIZE);
+		size_t *sample_sizes = malloc(list->len * sizeof(size_t));
+		size_t samples_size = 0;
+		unsigned int samples_len = 0;
+
+		for (int i = 0; i < list->len; i++) {
+			if (list->sizes[i] == 0 || list->sizes[i] > DICT_MAX_FILE_SIZE) {
+				continue;
+			}
+			if (samples_size + list->sizes[i] > DICT_MAX_SAMPLES_SIZE) {
+				break;
+			}
+			FILE *src = fopen(list->paths[i], "rb");
+			error_if(!src, "Could not open file %s for reading", list->paths[i]);
+			size_t bytes_read = fread(samples + samples_size, 1, list->sizes[i], src);
+			error_if(bytes_read != list->sizes[i], "read error for file %s", list->paths[i]);
+			fclose(src);
+
+			sample_sizes[samples_len++] = bytes_read;
+			samples_size += bytes_read;
+		}
+
+		state->dict = malloc(DICT_SIZE);
+		size_t dict_size = ZDICT_trainFromBuffer(state->dict, DICT_SIZE, samples, sample_sizes, samples_len);
+		free(samples);
+		free(sample_sizes);
+
+		if (ZDICT_isError(dict_size)) {
+			printf("Not using a dictionary: %s\n", ZDICT_getErrorName(dict_size));
+			free(state->dict);
+			state->dict = NULL;
+			return;
+		}
+		state->dict_size = dict_size;
+		state->cdict = ZSTD_createCDict(state->dict, state->dict_size, state->options->zstd_level);
+		error_if(!state->cdict, "Could not create compression dictionary");
+		printf("dictionary: %u bytes from %u samples\n", state->dict_size, samples_len);
+	#else
+		UNUSED(list); UNUSED(state);
+		die("qopconv was built without zstd support");
+	#endif
+}
+
+void *create_cctx(pack_state *state) {
+	#ifdef QOP_ZSTD
+		if (state->options->zstd_level) {
+			return ZSTD_createCCtx();
+		}
+	#else
+		UNUSED(state);
+	#endif
+	return NULL;
+}
+
+void free_cctx(void *cctx) {
+	#ifdef QOP_ZSTD
+		ZSTD_freeCCtx(cctx);
+	#else
+		UNUSED(cctx);
+	#endif
+}
+
+// The pack pipeline: worker threads read and compress items; the main thread
+// writes them in order. Workers may only run a limited number of items ahead
+// of the writer, to bound memory use.
+typedef struct {
+	pack_state *state;
+	path_list *list;
+	pack_item *items;
+	int items_len;
+	pack_result *results;
+	int window;
+	int next;
+	int written;
+	pi_mutex mutex;
+	pi_cond cond;
+} pack_queue;
+
+void *pack_worker(void *arg) {
+	pack_queue *q = arg;
+	void *cctx = create_cctx(q->state);
+
+	pi_mutex_lock(&q->mutex);
+	while (q->next < q->items_len) {
+		int i = q->next;
+		if (i >= q->written + q->window) {
+			pi_cond_wait(&q->cond, &q->mutex);
+			continue;
+		}
+		q->next++;
+		pi_mutex_unlock(&q->mutex);
+
+		pack_result result;
+		process_item(q->state, q->list, &q->items[i], cctx, &result);
+
+		pi_mutex_lock(&q->mutex);
+		result.ready = 1;
+		q->results[i % q->window] = result;
+		pi_cond_broadcast(&q->cond);
+	}
+	pi_mutex_unlock(&q->mutex);
+
+	free_cctx(cctx);
+	return NULL;
+}
+
+void write_files(path_list *list, FILE *dest, pack_state *state) {
+	// Split the files into items
+	int items_len = 0;
+	int items_capacity = list->len;
+	pack_item *items = malloc(items_capacity * sizeof(pack_item));
+	unsigned int chunk_size = state->options->chunk_size;
+	for (int i = 0; i < list->len; i++) {
+		unsigned int chunks_len = list->sizes[i] > chunk_size
+			? (list->sizes[i] + chunk_size - 1) / chunk_size
+			: 1;
+		for (unsigned int c = 0; c < chunks_len; c++) {
+			if (items_len >= items_capacity) {
+				items_capacity *= 2;
+				items = realloc(items, items_capacity * sizeof(pack_item));
+			}
+			qop_uint64_t offset = (qop_uint64_t)c * chunk_size;
+			qop_uint64_t remaining = list->sizes[i] - offset;
+			items[items_len++] = (pack_item){
+				.file = i,
+				.chunk = c,
+				.chunks_len = chunks_len,
+				.offset = offset,
+				.len = chunks_len == 1 || remaining < chunk_size ? remaining : chunk_size
+			};
+		}
+	}
+
+	// Single threaded: process and write each item in turn
+	if (state->options->jobs <= 1) {
+		void *cctx = create_cctx(state);
+		for (int i = 0; i < items_len; i++) {
+			pack_result result;
+			process_item(state, list, &items[i], cctx, &result);
+			write_item(state, list, &items[i], &result, dest);
+			free_result(&result);
+		}
+		free_cctx(cctx);
+		free(items);
+		return;
+	}
+
+	pack_queue q = {
+		.state = state,
+		.list = list,
+		.items = items,
+		.items_len = items_len,
+		.window = state->options->jobs * 4,
+		.next = 0,
+		.written = 0
 	};
-	state->size += size + path_len;
-	state->len++;
+	q.results = calloc(q.window, sizeof(pack_result));
+	pi_mutex_init(&q.mutex);
+	pi_cond_init(&q.cond);
+
+	pi_thread *threads = malloc(state->options->jobs * sizeof(pi_thread));
+	for (int i = 0; i < state->options->jobs; i++) {
+		error_if(pi_thread_create(&threads[i], pack_worker, &q) != 0, "Could not create thread");
+	}
+
+	for (int i = 0; i < items_len; i++) {
+		pi_mutex_lock(&q.mutex);
+		while (!q.results[i % q.window].ready) {
+			pi_cond_wait(&q.cond, &q.mutex);
+		}
+		pack_result result = q.results[i % q.window];
+		q.results[i % q.window].ready = 0;
+		pi_mutex_unlock(&q.mutex);
+
+		write_item(state, list, &items[i], &result, dest);
+		free_result(&result);
+
+		pi_mutex_lock(&q.mutex);
+		q.written = i + 1;
+		pi_cond_broadcast(&q.cond);
+		pi_mutex_unlock(&q.mutex);
+	}
+
+	for (int i = 0; i < state->options->jobs; i++) {
+		pi_thread_join(threads[i]);
+	}
+	free(threads);
+	pi_cond_destroy(&q.cond);
+	pi_mutex_destroy(&q.mutex);
+	free(q.results);
+	free(items);
+}
+
+void add_path(path_list *list, const char *path) {
+	if (list->len >= list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 1024;
+		list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+		list->sizes = realloc(list->sizes, list->capacity * sizeof(qop_uint64_t));
+	}
+	struct stat s;
+	error_if(stat(path, &s) != 0, "Could not stat file %s", path);
+
+	int path_len = strlen(path) + 1;
+	list->paths[list->len] = malloc(path_len);
+	memcpy(list->paths[list->len], path, path_len);
+	list->sizes[list->len] = s.st_size;
+	list->len++;
 }
 
-void add_dir(const char *path, FILE *dest, pack_state *state) {
+void scan_dir(const char *path, path_list *list) {
 	pi_dir *dir = pi_dir_open(path);
 	error_if(!dir, "Could not open directory %s for reading", path);
 
@@ -355,66 +1309,684 @@ void add_dir(const char *path, FILE *dest, pack_state *state) {
 		) {
 			char subpath[MAX_PATH_LEN];
 			snprintf(subpath, MAX_PATH_LEN, "%s/%s", path, entry->name);
-			add_dir(subpath, dest, state);
+			scan_dir(subpath, list);
 		}
 		else if (entry->is_file) {
 			char subpath[MAX_PATH_LEN];
 			snprintf(subpath, MAX_PATH_LEN, "%s/%s", path, entry->name);
-			add_file(subpath, dest, state);
+			add_path(list, subpath);
 		}
 	}
 	pi_dir_close(dir);
 }
 
-void pack(const char *read_dir, char **sources, int sources_len, const char *archive_path) {
-	FILE *dest = fopen(archive_path, "wb");
-	error_if(!dest, "Could not open file %s for writing", archive_path);
+// Move the files that appear in the access trace to the front of the list, in
+// the order of their first access. The trace has one path per line, as listed
+// by qopconv -l. All other files keep their order behind them.
+void order_by_trace(path_list *list, FILE *trace) {
+	unsigned int mask = qop_hashmap_len_for(list->len) - 1;
+	qop_file *map = calloc(mask + 1, sizeof(qop_file));
+	for (int i = 0; i < list->len; i++) {
+		qop_file f = {.hash = qop_hash(list->paths[i]), .size = 1, .path_offset = i};
+		qop_hashmap_insert(map, mask, &f);
+	}
+
+	int *rank = malloc(list->len * sizeof(int));
+	for (int i = 0; i < list->len; i++) {
+		rank[i] = -1;
+	}
+	int ordered = 0;
+	char line[MAX_PATH_LEN];
+	while (fgets(line, sizeof(line), trace)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		qop_uint64_t hash = qop_hash(line);
+		for (unsigned int j = hash & mask; map[j].size; j = (j + 1) & mask) {
+			int i = map[j].path_offset;
+			if (map[j].hash == hash && strcmp(list->paths[i], line) == 0) {
+				if (rank[i] < 0) {
+					rank[i] = ordered++;
+				}
+				break;
+			}
+		}
+	}
+
+	char **paths = malloc(list->capacity * sizeof(char *));
+	qop_uint64_t *sizes = malloc(list->capacity * sizeof(qop_uint64_t));
+	int next = ordered;
+	for (int i = 0; i < list->len; i++) {
+		int to = rank[i] >= 0 ? rank[i] : next++;
+		paths[to] = list->paths[i];
+		sizes[to] = list->sizes[i];
+	}
+	free(list->paths);
+	free(list->sizes);
+	list->paths = paths;
+	list->sizes = sizes;
+
+	printf("order: %d of %d files in trace order\n", ordered, list->len);
+	free(rank);
+	free(map);
+}
+
+// Order files by the position of their data; files that share data by their
+// index order, with the one that owns the data first
+int compare_data_offsets(const void *a, const void *b) {
+	const qop_file *fa = *(qop_file *const *)a;
+	const qop_file *fb = *(qop_file *const *)b;
+	qop_uint64_t da = fa->offset + fa->path_len;
+	qop_uint64_t db = fb->offset + fb->path_len;
+	if (da != db) {
+		return da < db ? -1 : 1;
+	}
+	int sa = fa->flags & QOP_FLAG_SHARED_DATA;
+	int sb = fb->flags & QOP_FLAG_SHARED_DATA;
+	if (sa != sb) {
+		return sa ? 1 : -1;
+	}
+	if (fa->path_offset != fb->path_offset) {
+		return fa->path_offset < fb->path_offset ? -1 : 1;
+	}
+	return fa->hash < fb->hash ? -1 : fa->hash > fb->hash;
+}
 
-	pack_state state = {
+void init_pack_state(pack_state *state, const pack_options *options) {
+	*state = (pack_state){
 		.files = malloc(sizeof(qop_file) * 1024),
+		.sources = malloc(sizeof(int) * 1024),
+		.content_hashes = malloc(sizeof(qop_uint64_t) * 1024),
 		.len = 0,
 		.capacity = 1024,
-		.size = 0
+		.size = 0,
+		.version = options->force_v2 || options->hash_type ? 2 : 1,
+		.hash_type = options->hash_type,
+		.paths = NULL,
+		.paths_len = 0,
+		.paths_capacity = 0,
+		.has_compressed = 0,
+		.dict = NULL,
+		.dict_size = 0,
+		.frame_offsets = NULL,
+		.dedup_map = NULL,
+		.dedup_map_len = 0,
+		.dedup_len = 0,
+		.dedup_saved = 0,
+		.options = options,
+		.sections_len = 0
 	};
+	#ifdef QOP_ZSTD
+		state->cdict = NULL;
+	#endif
+}
+
+// The number of bytes of a file's data in the archive, including the checksum
+qop_uint64_t data_size(qop_file *file) {
+	return file->stored_size + (file->flags & QOP_FLAG_CHECKSUM ? 8 : 0);
+}
+
+// Add a file that is already in the archive (when appending or compacting)
+void add_existing_file(pack_state *state, qop_file *file, const char *path) {
+	if (state->len >= state->capacity) {
+		state->capacity *= 2;
+		state->files = realloc(state->files, state->capacity * sizeof(qop_file));
+		state->sources = realloc(state->sources, state->capacity * sizeof(int));
+		state->content_hashes = realloc(state->content_hashes, state->capacity * sizeof(qop_uint64_t));
+	}
+	if (state->paths_len + file->path_len > state->paths_capacity) {
+		state->paths_capacity = (state->paths_len + file->path_len) * 2;
+		state->paths = realloc(state->paths, state->paths_capacity);
+	}
+	memcpy(state->paths + state->paths_len, path, file->path_len);
+
+	state->files[state->len] = *file;
+	state->files[state->len].path_offset = state->paths_len;
+	state->sources[state->len] = -1;
+	state->content_hashes[state->len] = 0;
+	state->paths_len += file->path_len;
+	state->has_compressed |= file->flags;
+	state->len++;
+}
+
+// Open an existing archive for appending or compacting. Loads the index, the 
+// paths and the dictionary, if any. Sets files to all entries of the index, 
+// including empty files, in the order of their data and sets archive_size, if
+// not NULL. Returns the number of files.
+unsigned int open_existing(const char *archive_path, qop_desc *qop, pack_state *state, qop_uint64_t *archive_size, qop_file ***files) {
+	qop_uint64_t size = qop_open(archive_path, qop);
+	error_if(!size, "Could not open archive %s", archive_path);
+	if (archive_size) {
+		*archive_size = size - qop->files_offset;
+	}
+	error_if(!qop_read_index(qop, malloc(qop->hashmap_size)), "Could not read index from archive %s", archive_path);
+	void *paths = malloc(qop->paths_size);
+	if (!qop_read_paths(qop, paths)) {
+		free(paths);
+	}
+
+	qop_section *ds = &qop->sections[QOP_SECTION_ZSTD_DICT];
+	if (ds->size) {
+		state->dict = malloc(ds->size);
+		state->dict_size = ds->size;
+		error_if(
+			qop_read_at(qop, qop->files_offset + ds->offset, state->dict, ds->size) != ds->size,
+			"Could not read dictionary from archive %s", archive_path
+		);
+	}
+	// Keep the version and hash type of the archive
+	if (qop->version == 2) {
+		state->version = 2;
+	}
+	state->hash_type = qop->hash_type;
+
+	// Empty files have no slot in the hashmap, so decode the index itself. The
+	// entries are stored behind the pointers, in the same allocation.
+	unsigned int len = qop->index_len;
+	*files = malloc((qop_uint64_t)len * (sizeof(qop_file *) + sizeof(qop_file)));
+	qop_file *entries = (qop_file *)(*files + len);
+	unsigned int path_offset = 0;
+	for (unsigned int i = 0; i < len; i += QOP_INDEX_BLOCK_LEN) {
+		unsigned int block_len = len - i < QOP_INDEX_BLOCK_LEN ? len - i : QOP_INDEX_BLOCK_LEN;
+		error_if(
+			!qop_read_index_block(qop, i, block_len, entries + i, &path_offset),
+			"Could not read index from archive %s", archive_path
+		);
+	}
+	for (unsigned int i = 0; i < len; i++) {
+		(*files)[i] = &entries[i];
+	}
+	qsort(*files, len, sizeof(qop_file *), compare_data_offsets);
+	return len;
+}
+
+// The alignment the file data of an existing archive was padded to; 1 for
+// archives without QOP_SECTION_ALIGN.
+unsigned int existing_align(qop_desc *qop, const char *archive_path) {
+	qop_section *as = &qop->sections[QOP_SECTION_ALIGN];
+	if (as->size < 4) {
+		return 1;
+	}
+	unsigned char b[4];
+	error_if(
+		qop_read_at(qop, qop->files_offset + as->offset, b, 4) != 4,
+		"Could not read alignment from archive %s", archive_path
+	);
+	unsigned int align = qop_get_32(b);
+	return align ? align : 1;
+}
+
+void close_existing(qop_desc *qop, qop_file **files) {
+	if (qop->paths_size) {
+		free((void *)qop->paths);
+	}
+	free(qop->hashmap);
+	free(files);
+	qop_close(qop);
+}
+
+// Write the optional sections, the index and the header. Returns the size of
+// the archive.
+qop_uint64_t finish_archive(FILE *dest, pack_state *state) {
+	const pack_options *options = state->options;
+
+	// Use version 2 of the format if the archive could exceed 4 GB with 
+	// everything that follows the file data
+	qop_uint64_t max_size = state->size + 
+		(qop_uint64_t)state->len * 12 + state->dict_size + state->paths_len + 
+		QOP_HASHMAP_HEADER_SIZE + (qop_uint64_t)qop_hashmap_len_for(state->len) * QOP_HASHMAP_SLOT_SIZE +
+		QOP_SECTION_MAX * (QOP_SECTION_SIZE + 8) + 8 + 4 +
+		(qop_uint64_t)state->len * QOP_INDEX_SIZE_V2 + QOP_HEADER_SIZE_V2;
+	if (max_size > 0xffffffff) {
+		state->version = 2;
+	}
+
+	// Write optional sections
+	if (options->align > 1) {
+		write_align(dest, state);
+	}
+	if (state->has_compressed & (QOP_FLAG_COMPRESSED_ZSTD | QOP_FLAG_COMPRESSED_DEFLATE)) {
+		write_sizes(dest, state);
+	}
+	if (state->dict && (state->has_compressed & QOP_FLAG_ZSTD_DICT)) {
+		write_dict(dest, state);
+	}
+	if (options->write_paths || (state->has_compressed & QOP_FLAG_SHARED_DATA)) {
+		write_paths(dest, state);
+		if (options->write_sorted) {
+			write_sorted_paths(dest, state);
+		}
+	}
+	if (options->write_hashmap) {
+		write_hashmap(dest, state);
+	}
+	write_sections(dest, state);
+
+	// Write index and header
+	qop_uint64_t total_size = state->size;
+	for (int i = 0; i < state->len; i++) {
+		write_64(state->files[i].hash, dest);
+		if (state->version == 2) {
+			write_64(state->files[i].offset, dest);
+			write_64(state->files[i].stored_size, dest);
+		}
+		else {
+			write_32(state->files[i].offset, dest);
+			write_32(state->files[i].stored_size, dest);
+		}
+		write_16(state->files[i].path_len, dest);
+		write_16(state->files[i].flags, dest);
+	}
+
+	if (state->version == 2) {
+		total_size += (qop_uint64_t)state->len * QOP_INDEX_SIZE_V2 + QOP_HEADER_SIZE_V2;
+		write_32(state->len, dest);
+		write_32(state->hash_type, dest);
+		write_64(total_size, dest);
+		write_32(QOP_MAGIC_V2, dest);
+	}
+	else {
+		total_size += state->len * QOP_INDEX_SIZE + QOP_HEADER_SIZE;
+		write_32(state->len, dest);
+		write_32(total_size, dest);
+		write_32(QOP_MAGIC, dest);
+	}
+
+	free(state->files);
+	free(state->sources);
+	free(state->content_hashes);
+	free(state->dedup_map);
+	free(state->frame_offsets);
+	free(state->paths);
+	free(state->dict);
+	#ifdef QOP_ZSTD
+		ZSTD_freeCDict(state->cdict);
+	#endif
+
+	printf("files: %d, size: %llu bytes\n", state->len, total_size);
+	if (options->dedup) {
+		printf("deduplicated: %llu bytes\n", state->dedup_saved);
+	}
+	return total_size;
+}
+
+// Create a new archive from the sources or, if append_path is set, add the
+// sources to an existing archive. Appending overwrites only the sections, the
+// index and the header of the existing archive. Files that are already in the
+// archive are replaced: the old entry is dropped from the index and its data
+// becomes dead space, until the archive is compacted.
+void pack(const char *read_dir, char **sources, int sources_len, const char *archive_path, const char *append_path, const pack_options *options) {
+	pack_state state;
+	init_pack_state(&state, options);
+
+	qop_desc qop;
+	qop_file **existing = NULL;
+	unsigned int existing_len = 0;
+	FILE *dest;
+	pack_options append_options;
+	if (append_path) {
+		existing_len = open_existing(append_path, &qop, &state, NULL, &existing);
+
+		// Keep the sections the archive already has
+		append_options = *options;
+		append_options.write_paths |= qop.sections[QOP_SECTION_PATHS].size > 0;
+		append_options.write_hashmap |= qop.sections[QOP_SECTION_HASHMAP].size > 0;
+		append_options.write_sorted |= qop.sections[QOP_SECTION_SORTED_PATHS].size > 0;
+		options = state.options = &append_options;
+
+		// New files are aligned like the existing ones
+		unsigned int align = existing_align(&qop, append_path);
+		error_if(
+			options->align && options->align != align,
+			"Archive %s is aligned to %u bytes; add files with --align %u or realign it with -c first",
+			append_path, align, align
+		);
+		append_options.align = align;
+
+		dest = fopen(append_path, "r+b");
+		error_if(!dest, "Could not open file %s for writing", append_path);
+	}
+	else {
+		dest = fopen(archive_path, "wb");
+		error_if(!dest, "Could not open file %s for writing", archive_path);
+	}
+
+	// Open the access trace before changing the directory
+	FILE *trace = NULL;
+	if (options->order_path) {
+		trace = fopen(options->order_path, "r");
+		error_if(!trace, "Could not open trace %s", options->order_path);
+	}
 
 	if (read_dir) {
 		error_if(chdir(read_dir) != 0, "Could not change to directory %s", read_dir);
 	}
 
-	// Add files/directories
+	// Collect files/directories
+	path_list list = {0};
 	for (int i = 0; i < sources_len; i++) {
 		struct stat s;
 		error_if(stat(sources[i], &s) != 0, "Could not stat file %s", sources[i]);
 		if (S_ISDIR(s.st_mode)) {
-			add_dir(sources[i], dest, &state);
+			scan_dir(sources[i], &list);
 		}
 		else if (S_ISREG(s.st_mode)) {
-			add_file(sources[i], dest, &state);
+			add_path(&list, sources[i]);
 		}
 		else {
 			die("Path %s is neither a directory nor a regular file", sources[i]);
 		}
 	}
+	if (trace) {
+		order_by_trace(&list, trace);
+		fclose(trace);
+	}
 
-	// Write index and header
-	unsigned int total_size = state.size + QOP_HEADER_SIZE;
-	for (int i = 0; i < state.len; i++) {
-		write_64(state.files[i].hash, dest);
-		write_32(state.files[i].offset, dest);
-		write_32(state.files[i].size, dest);
-		write_16(state.files[i].path_len, dest);
-		write_16(state.files[i].flags, dest);
-		total_size += 20;
+	// Keep all files of the existing archive that are not replaced. New data
+	// is written where the file data of the archive ended.
+	if (append_path) {
+		unsigned int new_mask = qop_hashmap_len_for(list.len) - 1;
+		qop_file *new_files = calloc(new_mask + 1, sizeof(qop_file));
+		for (int i = 0; i < list.len; i++) {
+			qop_file f = {.hash = qop_hash_path(state.hash_type, list.paths[i]), .size = 1, .path_offset = i};
+			qop_hashmap_insert(new_files, new_mask, &f);
+		}
+
+		qop_uint64_t data_end = 0;
+		for (unsigned int i = 0; i < existing_len; i++) {
+			char path[MAX_PATH_LEN];
+			error_if(existing[i]->path_len >= MAX_PATH_LEN || !qop_read_path(&qop, existing[i], path), "Could not read path of file %016llx", existing[i]->hash);
+			if (existing[i]->offset + existing[i]->path_len + data_size(existing[i]) > data_end) {
+				data_end = existing[i]->offset + existing[i]->path_len + data_size(existing[i]);
+			}
+			append_options.write_checksums |= (existing[i]->flags & QOP_FLAG_CHECKSUM) != 0;
+
+			int replaced = 0;
+			for (unsigned int j = existing[i]->hash & new_mask; new_files[j].size; j = (j + 1) & new_mask) {
+				if (new_files[j].hash == existing[i]->hash && strcmp(list.paths[new_files[j].path_offset], path) == 0) {
+					replaced = 1;
+					break;
+				}
+			}
+			if (replaced) {
+				printf("replace %s\n", path);
+			}
+			else {
+				add_existing_file(&state, existing[i], path);
+			}
+		}
+		free(new_files);
+
+		state.size = data_end;
+		error_if(pi_fseek(dest, qop.files_offset + data_end, SEEK_SET) != 0, "Could not seek in %s", append_path);
 	}
 
-	write_32(state.len, dest);
-	write_32(total_size, dest);
-	write_32(QOP_MAGIC, dest);
+	if (state.dict && options->zstd_level) {
+		#ifdef QOP_ZSTD
+			state.cdict = ZSTD_createCDict(state.dict, state.dict_size, options->zstd_level);
+			error_if(!state.cdict, "Could not create compression dictionary");
+		#endif
+	}
+	else if (options->zstd_dict) {
+		train_dict(&list, &state);
+	}
 
-	free(state.files);
+	// Add files
+	write_files(&list, dest, &state);
+	for (int i = 0; i < list.len; i++) {
+		free(list.paths[i]);
+	}
+	free(list.paths);
+	free(list.sizes);
+
+	qop_uint64_t total_size = finish_archive(dest, &state);
+	if (append_path) {
+		error_if(pi_ftruncate(dest, qop.files_offset + total_size) != 0, "Could not truncate %s", append_path);
+		close_existing(&qop, existing);
+	}
+	fclose(dest);
+}
+
+// Rewrite an archive without the dead space left by replaced files. The 
+// archive is written to a temporary file next to it that then replaces the
+// original. Data is copied as stored; nothing is recompressed.
+void compact(const char *archive_path, const pack_options *options) {
+	pack_state state;
+	init_pack_state(&state, options);
+
+	qop_desc qop;
+	qop_uint64_t old_size;
+	qop_file **existing;
+	unsigned int existing_len = open_existing(archive_path, &qop, &state, &old_size, &existing);
+
+	// Keep the sections the archive already has
+	pack_options compact_options = *options;
+	compact_options.write_paths |= qop.sections[QOP_SECTION_PATHS].size > 0;
+	compact_options.write_hashmap |= qop.sections[QOP_SECTION_HASHMAP].size > 0;
+	compact_options.write_sorted |= qop.sections[QOP_SECTION_SORTED_PATHS].size > 0;
+	if (!compact_options.align) {
+		compact_options.align = existing_align(&qop, archive_path);
+	}
+	options = state.options = &compact_options;
+
+	char tmp_path[MAX_PATH_LEN];
+	snprintf(tmp_path, MAX_PATH_LEN, "%s.tmp", archive_path);
+	FILE *dest = fopen(tmp_path, "wb");
+	error_if(!dest, "Could not open file %s for writing", tmp_path);
+
+	unsigned char *buffer = malloc(CHUNK_SIZE);
+
+	// Keep everything in front of the archive, e.g. an executable
+	for (qop_uint64_t pos = 0; pos < qop.files_offset; pos += CHUNK_SIZE) {
+		unsigned int len = qop.files_offset - pos < CHUNK_SIZE ? qop.files_offset - pos : CHUNK_SIZE;
+		error_if(qop_read_at(&qop, pos, buffer, len) != len, "read error for archive %s", archive_path);
+		error_if(fwrite(buffer, 1, len, dest) != len, "Write error");
+	}
+
+	// Files are in the order of their data; files that share data are next to
+	// each other. The first file of each group gets a copy of the data. As in
+	// write_item(), the copy must be far enough into the archive to be 
+	// addressed as offset + path_len; a file with a longer path than the owner
+	// may not fit in front of it and then gets a copy of its own.
+	qop_uint64_t prev_data = 0;
+	qop_uint64_t new_data = 0;
+	for (unsigned int i = 0; i < existing_len; i++) {
+		qop_file file = *existing[i];
+		char path[MAX_PATH_LEN];
+		error_if(file.path_len >= MAX_PATH_LEN || !qop_read_path(&qop, &file, path), "Could not read path of file %016llx", file.hash);
+
+		qop_uint64_t data = file.offset + file.path_len;
+		if (i > 0 && data == prev_data && new_data >= file.path_len) {
+			file.offset = new_data - file.path_len;
+			file.flags |= QOP_FLAG_SHARED_DATA;
+		}
+		else {
+			while ((state.size + file.path_len) % options->align) {
+				error_if(fputc(0, dest) == EOF, "Write error");
+				state.size++;
+			}
+			error_if(fwrite(path, 1, file.path_len, dest) != file.path_len, "Write error");
+
+			qop_uint64_t src = qop.files_offset + data;
+			qop_uint64_t size = data_size(&file);
+			for (qop_uint64_t pos = 0; pos < size; pos += CHUNK_SIZE) {
+				unsigned int len = size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE;
+				error_if(qop_read_at(&qop, src + pos, buffer, len) != len, "read error for file %s", path);
+				error_if(fwrite(buffer, 1, len, dest) != len, "Write error");
+			}
+
+			file.offset = state.size;
+			file.flags &= ~QOP_FLAG_SHARED_DATA;
+			state.size += file.path_len + size;
+			prev_data = data;
+			new_data = file.offset + file.path_len;
+		}
+		add_existing_file(&state, &file, path);
+	}
+	free(buffer);
+
+	qop_uint64_t total_size = finish_archive(dest, &state);
+	printf("reclaimed: %lld bytes\n", (long long)(old_size - total_size));
+	close_existing(&qop, existing);
 	fclose(dest);
+	error_if(pi_replace(tmp_path, archive_path) != 0, "Could not replace %s", archive_path);
+}
+
+
+// -----------------------------------------------------------------------------
+// Verify
+
+typedef struct {
+	qop_desc *qop;
+	qop_file **files;
+	int len;
+	int next;
+	qop_uint64_t bytes;
+	int failed;
+	pi_mutex mutex;
+} verify_queue;
+
+// Check the contents of a file against its checksum. Uncompressed files of a
+// mapped archive are hashed in place; all others are streamed.
+int verify_file(qop_desc *qop, qop_file *file) {
+	unsigned long long expected;
+	if (!qop_read_checksum(qop, file, &expected)) {
+		return 0;
+	}
+
+	const unsigned char *data = qop_data(qop, file);
+	if (data) {
+		return qop_checksum(data, file->size) == expected;
+	}
+
+	qop_stream stream;
+	if (!qop_stream_open(qop, file, &stream)) {
+		return 0;
+	}
+	qop_checksum_state checksum;
+	qop_checksum_init(&checksum);
+	unsigned char *buffer = malloc(CHUNK_SIZE);
+	qop_uint64_t total = 0;
+	unsigned int len;
+	while ((len = qop_stream_read(&stream, buffer, CHUNK_SIZE)) > 0) {
+		qop_checksum_update(&checksum, buffer, len);
+		total += len;
+	}
+	free(buffer);
+	qop_stream_close(&stream);
+	return total == file->size && qop_checksum_final(&checksum) == expected;
+}
+
+void *verify_worker(void *arg) {
+	verify_queue *q = arg;
+	while (1) {
+		pi_mutex_lock(&q->mutex);
+		int i = q->next++;
+		pi_mutex_unlock(&q->mutex);
+		if (i >= q->len) {
+			break;
+		}
+
+		qop_file *file = q->files[i];
+		int ok = verify_file(q->qop, file);
+		if (!ok) {
+			char path[MAX_PATH_LEN];
+			if (file->path_len >= MAX_PATH_LEN || !qop_read_path(q->qop, file, path)) {
+				snprintf(path, MAX_PATH_LEN, "%016llx", file->hash);
+			}
+			printf("FAILED %s\n", path);
+		}
+
+		pi_mutex_lock(&q->mutex);
+		q->bytes += file->size;
+		q->failed += !ok;
+		pi_mutex_unlock(&q->mutex);
+	}
+	return NULL;
+}
+
+// Check all files with a checksum. Each range of data (offset and stored size)
+// is only checked once, even if several files share it. Returns the number of
+// failed files.
+int verify(const char *archive_path, int jobs) {
+	qop_desc qop;
+	qop_uint64_t archive_size = qop_open_mmap(archive_path, &qop);
+	if (archive_size == 0) {
+		archive_size = qop_open(archive_path, &qop);
+	}
+	error_if(archive_size == 0, "Could not open archive %s", archive_path);
+
+	// With a stored hashmap, qop.hashmap may point into the mapping; only free 
+	// our own buffer
+	void *hashmap = malloc(qop.hashmap_size);
+	int index_len = qop_read_index(&qop, hashmap);
+	error_if(index_len == 0, "Could not read index from archive %s", archive_path);
+	void *paths = malloc(qop.paths_size);
+	qop_read_paths(&qop, paths);
+
+	// Check the files in the order of their data. Shared files can't be 
+	// skipped: the file that owned the data may have been replaced with -a.
+	qop_file **files = malloc(index_len * sizeof(qop_file *));
+	int files_len = 0;
+	for (unsigned int i = 0; i < qop.hashmap_len; i++) {
+		if (qop.hashmap[i].size) {
+			files[files_len++] = &qop.hashmap[i];
+		}
+	}
+	qsort(files, files_len, sizeof(qop_file *), compare_data_offsets);
 
-	printf("files: %d, size: %d bytes\n", state.len, total_size);
+	verify_queue q = {
+		.qop = &qop,
+		.files = malloc(index_len * sizeof(qop_file *)),
+		.len = 0,
+		.next = 0,
+		.bytes = 0,
+		.failed = 0
+	};
+	int unchecked = 0;
+	int first = 0;
+	for (int i = 0; i < files_len; i++) {
+		qop_file *file = files[i];
+		qop_uint64_t data = file->offset + file->path_len;
+		if (data != files[first]->offset + files[first]->path_len) {
+			first = i;
+		}
+		int seen = 0;
+		for (int j = first; j < i && !seen; j++) {
+			seen = files[j]->stored_size == file->stored_size;
+		}
+		if (seen) {
+			continue;
+		}
+		if (file->flags & QOP_FLAG_CHECKSUM) {
+			q.files[q.len++] = file;
+		}
+		else {
+			unchecked++;
+		}
+	}
+	free(files);
+
+	pi_mutex_init(&q.mutex);
+	pi_thread *threads = malloc(jobs * sizeof(pi_thread));
+	for (int i = 0; i < jobs; i++) {
+		error_if(pi_thread_create(&threads[i], verify_worker, &q) != 0, "Could not create thread");
+	}
+	for (int i = 0; i < jobs; i++) {
+		pi_thread_join(threads[i]);
+	}
+	free(threads);
+	pi_mutex_destroy(&q.mutex);
+
+	printf("verified: %d files, %llu bytes\n", q.len, q.bytes);
+	if (unchecked) {
+		printf("no checksum: %d files\n", unchecked);
+	}
+	printf("failed: %d files\n", q.failed);
+
+	free(q.files);
+	free(paths);
+	qop_close(&qop);
+	free(hashmap);
+	return q.failed;
 }
 
 void exit_usage(void) {
@@ -426,13 +1998,55 @@ void exit_usage(void) {
 		"  qopconv foo bar archive.qop       # Create archive.qop from files foo and bar\n"
 		"  qoponvv -u archive.qop            # Unpack archive.qop in current directory\n"
 		"  qopconv -l archive.qop            # List files in archive.qop\n"
+		"  qopconv -u archive.qop -j 8       # Unpack archive.qop in 8 threads\n"
+		"  qopconv -a archive.qop foo        # Add or replace foo in archive.qop\n"
 		"  qopconv -d dir1 dir2 archive.qop  # Use dir1 prefix for reading, create\n"
 		"                                      archive.qop from files in dir1/dir2/\n"
 		"\n"
 		"Options (mutually exclusive):\n"
 		"  -u <archive> ... unpack archive\n"
 		"  -l <archive> ... list contents of archive\n"
+		"  -a <archive> ... add files to archive; files with the same path are\n"
+		"                   replaced\n"
+		"  -c <archive> ... compact archive: remove the data of replaced files;\n"
+		"                   keeps the alignment of the archive, unless --align\n"
+		"                   is given\n"
+		"  --stats <archive> show sizes of the index and paths and a histogram of\n"
+		"                   the hashmap probe lengths\n"
+		"  --verify <archive> check the contents of all files that have a\n"
+		"                   checksum; exits with 1 if any file fails\n"
 		"  -d <dir> ....... change read dir when creating archives\n"
+		"\n"
+		"Options:\n"
+		"  -j <jobs> ...... number of threads for packing, unpacking and\n"
+		"                   verifying; the created archive is the same for any\n"
+		"                   number\n"
+		"\n"
+		"Options when creating archives:\n"
+		"  --hashmap ...... store a prebuilt hashmap in the archive\n"
+		"  --paths ........ store all paths in one table in the archive\n"
+		"  --zstd <level> . compress files with zstd at the given level, if it\n"
+		"                   makes them smaller\n"
+		"  --dict ......... with --zstd: train a dictionary on all small files and\n"
+		"                   use it to compress them\n"
+		"  --chunk <size> . with --zstd: compress files larger than size in\n"
+		"                   independent chunks of size bytes (default 1048576)\n"
+		"  --align <n> .... pad files so that their data starts at a multiple of\n"
+		"                   n bytes from the start of the archive; stored in the\n"
+		"                   archive and kept by -a, which fails if n differs\n"
+		"  --sorted ....... store a sorted path index to find all files with a\n"
+		"                   common prefix (qop_iter_prefix()); implies --paths\n"
+		"  --order <trace>  store the files listed in trace (one path per line,\n"
+		"                   as shown by -l) first, in the order of their first\n"
+		"                   appearance, so that they can be read sequentially\n"
+		"  --checksums .... store a checksum (XXH64) of the contents of each file,\n"
+		"                   checked by --verify and qop_read() with qop.verify\n"
+		"  --dedup ........ store files with identical contents only once;\n"
+		"                   implies --paths\n"
+		"  --hash <type> .. hash function for paths: murmur (default) or word64;\n"
+		"                   word64 is faster, but requires version 2\n"
+		"  --v2 ........... always use version 2 of the format with 64 bit\n"
+		"                   offsets; otherwise only used for archives > 4 GB\n"
 	);
 	exit(1);
 }
@@ -442,24 +2056,140 @@ int main(int argc, char **argv) {
 		exit_usage();
 	}
 
+	pack_options options = {.chunk_size = CHUNK_SIZE, .jobs = 1};
+	char *read_dir = NULL;
+	char *unpack_path = NULL;
+	char *append_path = NULL;
+	char *compact_path = NULL;
+	char *stats_path = NULL;
+	char *verify_path = NULL;
+	int list_only = 0;
+	int files_start = 1;
+	while (files_start < argc && argv[files_start][0] == '-') {
+		int has_arg = files_start + 1 < argc;
+		if (strcmp(argv[files_start], "-u") == 0 && has_arg) {
+			unpack_path = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "-l") == 0 && has_arg) {
+			unpack_path = argv[++files_start];
+			list_only = 1;
+		}
+		else if (strcmp(argv[files_start], "-a") == 0 && has_arg) {
+			append_path = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "-c") == 0 && has_arg) {
+			compact_path = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "--stats") == 0 && has_arg) {
+			stats_path = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "--verify") == 0 && has_arg) {
+			verify_path = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "-d") == 0 && has_arg) {
+			read_dir = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "-j") == 0 && has_arg) {
+			options.jobs = atoi(argv[++files_start]);
+			error_if(options.jobs <= 0, "Invalid number of jobs %s", argv[files_start]);
+		}
+		else if (strcmp(argv[files_start], "--hashmap") == 0) {
+			options.write_hashmap = 1;
+		}
+		else if (strcmp(argv[files_start], "--paths") == 0) {
+			options.write_paths = 1;
+		}
+		else if (strcmp(argv[files_start], "--zstd") == 0 && has_arg) {
+			options.zstd_level = atoi(argv[++files_start]);
+			error_if(options.zstd_level == 0, "Invalid compression level %s", argv[files_start]);
+		}
+		else if (strcmp(argv[files_start], "--dict") == 0) {
+			options.zstd_dict = 1;
+		}
+		else if (strcmp(argv[files_start], "--align") == 0 && has_arg) {
+			options.align = atoi(argv[++files_start]);
+			error_if(options.align == 0, "Invalid alignment %s", argv[files_start]);
+		}
+		else if (strcmp(argv[files_start], "--sorted") == 0) {
+			options.write_sorted = 1;
+			options.write_paths = 1;
+		}
+		else if (strcmp(argv[files_start], "--order") == 0 && has_arg) {
+			options.order_path = argv[++files_start];
+		}
+		else if (strcmp(argv[files_start], "--checksums") == 0) {
+			options.write_checksums = 1;
+		}
+		else if (strcmp(argv[files_start], "--dedup") == 0) {
+			options.dedup = 1;
+			options.write_paths = 1;
+		}
+		else if (strcmp(argv[files_start], "--hash") == 0 && has_arg) {
+			files_start++;
+			if (strcmp(argv[files_start], "murmur") == 0) {
+				options.hash_type = QOP_HASH_MURMUR_OAAT;
+			}
+			else if (strcmp(argv[files_start], "word64") == 0) {
+				options.hash_type = QOP_HASH_WORD64;
+			}
+			else {
+				die("Unknown hash type %s", argv[files_start]);
+			}
+		}
+		else if (strcmp(argv[files_start], "--v2") == 0) {
+			options.force_v2 = 1;
+		}
+		else if (strcmp(argv[files_start], "--chunk") == 0 && has_arg) {
+			options.chunk_size = atoi(argv[++files_start]);
+			error_if(options.chunk_size == 0, "Invalid chunk size %s", argv[files_start]);
+		}
+		else {
+			exit_usage();
+		}
+		files_start++;
+	}
+	#ifndef QOP_ZSTD
+		error_if(options.zstd_level || options.zstd_dict, "qopconv was built without zstd support");
+	#endif
+	error_if(options.zstd_dict && !options.zstd_level, "--dict requires --zstd");
+
 	// Unpack
-	if (strcmp(argv[1], "-u") == 0) {
-		unpack(argv[2], 0);	
+	if (unpack_path) {
+		unpack(unpack_path, list_only, options.jobs);
 	}
-	else if (strcmp(argv[1], "-l") == 0) {
-		unpack(argv[2], 1);
+
+	// Stats
+	else if (stats_path) {
+		print_stats(stats_path);
 	}
-	else {
-		int files_start = 1;
-		char *read_dir = NULL;
-		if (strcmp(argv[1], "-d") == 0) {
-			read_dir = argv[2];
-			files_start = 3;
+
+	// Verify
+	else if (verify_path) {
+		return verify(verify_path, options.jobs) ? 1 : 0;
+	}
+
+	// Compact
+	else if (compact_path) {
+		compact(compact_path, &options);
+	}
+
+	// Append
+	else if (append_path) {
+		if (argc < 1 + files_start) {
+			exit_usage();
 		}
+		pack(read_dir, argv + files_start, argc - files_start, NULL, append_path, &options);
+	}
+
+	// Pack
+	else {
 		if (argc < 2 + files_start) {
 			exit_usage();
 		}
-		pack(read_dir, argv + files_start, argc - 1 - files_start, argv[argc-1]);
+		if (!options.align) {
+			options.align = 1;
+		}
+		pack(read_dir, argv + files_start, argc - 1 - files_start, argv[argc-1], NULL, &options);
 	}
 	return 0;
 }
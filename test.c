@@ -0,0 +1,843 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+
+Tests for the qop library and qopconv
+
+Writes files to a temporary directory, packs them with qopconv and checks the
+archives through qop.h and qopconv. Each passed test prints one line:
+
+ok <TAB> name
+
+The first failure prints where it happened and exits with 1.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define QOP_IMPLEMENTATION
+#include "qop.h"
+
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+#define die(...) \
+	printf("Abort at " TOSTRING(__FILE__) " line " TOSTRING(__LINE__) ": " __VA_ARGS__); \
+	printf("\n"); \
+	exit(1)
+
+#define error_if(TEST, ...) \
+	if (TEST) { \
+		die(__VA_ARGS__); \
+	}
+
+#define MAX_PATH_LEN 1024
+#define TEST_ROOT "test"
+#define STRESS_FILES 300
+#define STRESS_MAX_SIZE (256 * 1024)
+#define STRESS_THREADS 8
+#define STRESS_OPS 4000
+#define LARGE_SIZE (8ull * 1024 * 1024 * 1024 + 512 * 1024 * 1024 + 13)
+
+
+// -----------------------------------------------------------------------------
+// Helpers
+
+typedef struct {
+	const char *qopconv;
+	const char *work_dir;
+	int skip_large;
+} test_options;
+
+typedef struct {
+	char *path;
+	unsigned char *data;
+	unsigned int size;
+} test_file;
+
+static test_options options;
+static char base_dir[MAX_PATH_LEN / 2];
+
+static unsigned int rng(qop_uint64_t *state) {
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static void passed(const char *name) {
+	printf("ok\t%s\n", name);
+	fflush(stdout);
+}
+
+static int run_status(const char *cmd) {
+	int status = system(cmd);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void run(const char *cmd) {
+	error_if(run_status(cmd) != 0, "Command failed: %s", cmd);
+}
+
+// Run qopconv with the arguments, from dir in the base dir, with its output
+// hidden. Returns the exit code.
+static int qopconv_in(const char *dir, const char *args) {
+	char cmd[MAX_PATH_LEN * 4];
+	snprintf(cmd, sizeof(cmd), "cd %s/%s && %s %s > /dev/null 2>&1", base_dir, dir, options.qopconv, args);
+	return run_status(cmd);
+}
+
+static int qopconv(const char *args) {
+	return qopconv_in(".", args);
+}
+
+static void base_path(char *dest, const char *path) {
+	snprintf(dest, MAX_PATH_LEN, "%s/%s", base_dir, path);
+}
+
+static void create_parent_dirs(char *path) {
+	for (char *p = path + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(path, 0755);
+			*p = '/';
+		}
+	}
+}
+
+// Write a file relative to the base dir, creating its directories
+static void write_file(const char *path, const void *data, unsigned int size) {
+	char full[MAX_PATH_LEN];
+	base_path(full, path);
+	create_parent_dirs(full);
+	FILE *fh = fopen(full, "wb");
+	error_if(!fh, "Could not open %s for writing", full);
+	error_if(size && fwrite(data, size, 1, fh) != 1, "Could not write %s", full);
+	fclose(fh);
+}
+
+// Read a file relative to the base dir. Returns NULL if it does not exist.
+static unsigned char *read_file(const char *path, unsigned int *size) {
+	char full[MAX_PATH_LEN];
+	base_path(full, path);
+	FILE *fh = fopen(full, "rb");
+	if (!fh) {
+		return NULL;
+	}
+	fseek(fh, 0, SEEK_END);
+	*size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	unsigned char *data = malloc(*size + 1);
+	error_if(*size && fread(data, *size, 1, fh) != 1, "Could not read %s", full);
+	fclose(fh);
+	return data;
+}
+
+// Check that the file at path has the expected contents
+static int file_equals(const char *path, const void *data, unsigned int size) {
+	unsigned int file_size;
+	unsigned char *file_data = read_file(path, &file_size);
+	int equals = file_data && file_size == size && memcmp(file_data, data, size) == 0;
+	free(file_data);
+	return equals;
+}
+
+// Create len files with random contents under dir (relative to the base dir)
+// and keep their contents for comparison
+static test_file *make_files(const char *dir, int len, unsigned int max_size, qop_uint64_t seed) {
+	test_file *files = malloc(len * sizeof(test_file));
+	for (int i = 0; i < len; i++) {
+		files[i].path = malloc(MAX_PATH_LEN);
+		snprintf(files[i].path, MAX_PATH_LEN, "%s/%02u/file_%04d.bin", dir, rng(&seed) % 16, i);
+		files[i].size = 1 + rng(&seed) % max_size;
+		files[i].data = malloc(files[i].size);
+		for (unsigned int j = 0; j < files[i].size; j++) {
+			files[i].data[j] = rng(&seed);
+		}
+		write_file(files[i].path, files[i].data, files[i].size);
+	}
+	return files;
+}
+
+static void free_files(test_file *files, int len) {
+	for (int i = 0; i < len; i++) {
+		free(files[i].path);
+		free(files[i].data);
+	}
+	free(files);
+}
+
+typedef unsigned long long (*open_func)(const char *path, qop_desc *qop);
+
+// Open an archive relative to the base dir and load its index and paths. The
+// buffers are returned in index and paths and must be freed after qop_close().
+static void open_archive(open_func open, const char *path, qop_desc *qop, void **index, void **paths) {
+	char full[MAX_PATH_LEN];
+	base_path(full, path);
+	error_if(!open(full, qop), "Could not open %s", full);
+	*index = malloc(qop->hashmap_size);
+	error_if(!qop_read_index(qop, *index), "Could not read index of %s", full);
+	*paths = malloc(qop->paths_size);
+	qop_read_paths(qop, *paths);
+}
+
+
+// Check whether the index of an opened archive has an entry for path. Unlike
+// qop_find(), this also sees empty files, which have no slot in the hashmap.
+static int index_has_path(qop_desc *qop, const char *path) {
+	qop_file file;
+	char file_path[MAX_PATH_LEN];
+	unsigned int path_offset = 0;
+	for (unsigned int i = 0; i < qop->index_len; i++) {
+		error_if(!qop_read_index_block(qop, i, 1, &file, &path_offset), "Could not read index entry %u", i);
+		if (
+			file.path_len < MAX_PATH_LEN &&
+			qop_read_path(qop, &file, file_path) &&
+			strcmp(file_path, path) == 0
+		) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// Concurrent reads: many threads read random files, ranges and paths from one
+// qop_desc at the same time and compare them with the source files
+
+typedef struct {
+	qop_desc *qop;
+	test_file *files;
+	int files_len;
+	qop_uint64_t seed;
+	int errors;
+} stress_thread;
+
+static void *stress_worker(void *arg) {
+	stress_thread *t = arg;
+	unsigned char *buffer = malloc(STRESS_MAX_SIZE);
+	char path[MAX_PATH_LEN];
+	for (int i = 0; i < STRESS_OPS; i++) {
+		test_file *src = &t->files[rng(&t->seed) % t->files_len];
+		qop_file *file = qop_find(t->qop, src->path);
+		if (!file || file->size != src->size) {
+			t->errors++;
+			continue;
+		}
+
+		switch (rng(&t->seed) % 3) {
+			case 0:
+				t->errors +=
+					qop_read(t->qop, file, buffer) != src->size ||
+					memcmp(buffer, src->data, src->size) != 0;
+				break;
+			case 1: {
+				unsigned int start = rng(&t->seed) % src->size;
+				unsigned int len = 1 + rng(&t->seed) % (src->size - start);
+				t->errors +=
+					qop_read_ex(t->qop, file, buffer, start, len) != len ||
+					memcmp(buffer, src->data + start, len) != 0;
+				break;
+			}
+			case 2:
+				t->errors +=
+					qop_read_path(t->qop, file, path) != (int)strlen(src->path) + 1 ||
+					strcmp(path, src->path) != 0;
+				break;
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+static void test_concurrent_reads(void) {
+	test_file *files = make_files(TEST_ROOT "/stress", STRESS_FILES, STRESS_MAX_SIZE, 1);
+	const char *flags[] = {"", "--hashmap --paths"};
+	open_func opens[] = {qop_open, qop_open_mmap};
+
+	for (int f = 0; f < 2; f++) {
+		char args[MAX_PATH_LEN];
+		snprintf(args, sizeof(args), "%s " TEST_ROOT "/stress stress.qop", flags[f]);
+		error_if(qopconv(args) != 0, "Could not pack with %s", args);
+
+		for (int o = 0; o < 2; o++) {
+			qop_desc qop;
+			void *index, *paths;
+			open_archive(opens[o], "stress.qop", &qop, &index, &paths);
+
+			stress_thread threads[STRESS_THREADS];
+			pthread_t ids[STRESS_THREADS];
+			for (int i = 0; i < STRESS_THREADS; i++) {
+				threads[i] = (stress_thread){.qop = &qop, .files = files, .files_len = STRESS_FILES, .seed = i + 1};
+				error_if(pthread_create(&ids[i], NULL, stress_worker, &threads[i]) != 0, "Could not create thread");
+			}
+			int errors = 0;
+			for (int i = 0; i < STRESS_THREADS; i++) {
+				pthread_join(ids[i], NULL);
+				errors += threads[i].errors;
+			}
+			error_if(errors, "%d of %d concurrent reads failed (flags \"%s\", %s)",
+				errors, STRESS_THREADS * STRESS_OPS, flags[f], o ? "mmap" : "pread");
+
+			qop_close(&qop);
+			free(index);
+			free(paths);
+		}
+	}
+	free_files(files, STRESS_FILES);
+	passed("concurrent_reads");
+}
+
+
+// -----------------------------------------------------------------------------
+// Read ranges: qop_read_ex() cuts ranges off at the end of the file and never
+// returns bytes of the next file
+
+static void test_read_ranges(void) {
+	test_file *files = make_files(TEST_ROOT "/ranges", 16, 4096, 2);
+	error_if(qopconv(TEST_ROOT "/ranges ranges.qop") != 0, "Could not pack the range test files");
+
+	open_func opens[] = {qop_open, qop_open_mmap};
+	unsigned char buffer[4096 + 256];
+	for (int o = 0; o < 2; o++) {
+		qop_desc qop;
+		void *index, *paths;
+		open_archive(opens[o], "ranges.qop", &qop, &index, &paths);
+
+		for (int i = 0; i < 16; i++) {
+			qop_file *file = qop_find(&qop, files[i].path);
+			error_if(!file, "File %s not found", files[i].path);
+			unsigned int size = files[i].size;
+			unsigned int start = size > 5 ? size - 5 : 0;
+
+			memset(buffer, 0xaa, sizeof(buffer));
+			error_if(
+				qop_read_ex(&qop, file, buffer, start, 256) != size - start ||
+				memcmp(buffer, files[i].data + start, size - start) != 0 ||
+				buffer[size - start] != 0xaa,
+				"Range past the end of %s not cut off", files[i].path
+			);
+			error_if(
+				qop_read_ex(&qop, file, buffer, size, 1) != 0 ||
+				qop_read_ex(&qop, file, buffer, size + 100, 1) != 0,
+				"Range after the end of %s not empty", files[i].path
+			);
+		}
+
+		qop_close(&qop);
+		free(index);
+		free(paths);
+	}
+	free_files(files, 16);
+	passed("read_ranges");
+}
+
+
+// -----------------------------------------------------------------------------
+// Batch reads: qop_read_batch() reads all files of an archive at once, through
+// io_uring or, when built with QOP_NO_IO_URING, in multiple threads. The
+// contents must be the same as with qop_read().
+
+#define BATCH_FILES 200
+
+static unsigned int batch_callbacks;
+
+static void batch_callback(qop_read_request *request) {
+	(void)request;
+	__sync_fetch_and_add(&batch_callbacks, 1);
+}
+
+static void test_read_batch(void) {
+	test_file *files = make_files(TEST_ROOT "/batch", BATCH_FILES, 64 * 1024, 3);
+	error_if(qopconv(TEST_ROOT "/batch batch.qop") != 0, "Could not pack the batch test files");
+
+	open_func opens[] = {qop_open, qop_open_mmap};
+	qop_read_request *requests = malloc(BATCH_FILES * sizeof(qop_read_request));
+	unsigned char *expected = malloc(64 * 1024);
+	for (int o = 0; o < 2; o++) {
+		qop_desc qop;
+		void *index, *paths;
+		open_archive(opens[o], "batch.qop", &qop, &index, &paths);
+
+		for (int i = 0; i < BATCH_FILES; i++) {
+			requests[i].file = qop_find(&qop, files[i].path);
+			error_if(!requests[i].file, "File %s not found", files[i].path);
+			requests[i].dest = malloc(requests[i].file->size);
+		}
+		batch_callbacks = 0;
+		error_if(
+			qop_read_batch(&qop, requests, BATCH_FILES, batch_callback) != BATCH_FILES ||
+			batch_callbacks != BATCH_FILES,
+			"Batch read of %d files incomplete", BATCH_FILES
+		);
+		for (int i = 0; i < BATCH_FILES; i++) {
+			qop_file *file = requests[i].file;
+			error_if(
+				requests[i].bytes_read != file->size ||
+				qop_read(&qop, file, expected) != file->size ||
+				memcmp(requests[i].dest, expected, file->size) != 0,
+				"Batch read of %s differs from qop_read()", files[i].path
+			);
+			free(requests[i].dest);
+		}
+
+		qop_close(&qop);
+		free(index);
+		free(paths);
+	}
+	free(expected);
+	free(requests);
+	free_files(files, BATCH_FILES);
+	passed("read_batch");
+}
+
+
+// -----------------------------------------------------------------------------
+// Corrupt hashmap: a stored hashmap section without an empty slot must not 
+// make qop_find() loop forever on a miss
+
+static void test_full_hashmap(void) {
+	test_file *files = make_files(TEST_ROOT "/full", 8, 1024, 5);
+	error_if(qopconv("--hashmap " TEST_ROOT "/full full.qop") != 0, "Could not pack the hashmap test files");
+	unsigned int size;
+	unsigned char *data = read_file("full.qop", &size);
+	error_if(!data, "Could not read full.qop");
+
+	// Give every empty slot a size, so that the probing never hits one
+	qop_desc qop;
+	error_if(!qop_open_memory(data, size, &qop), "Could not open full.qop");
+	qop_section *hs = &qop.sections[QOP_SECTION_HASHMAP];
+	error_if(!hs->size, "No hashmap section in full.qop");
+	unsigned char *slots = data + qop.files_offset + hs->offset + QOP_HASHMAP_HEADER_SIZE;
+	for (unsigned int i = 0; i < qop.hashmap_len; i++) {
+		unsigned char *slot_size = slots + i * QOP_HASHMAP_SLOT_SIZE + 16;
+		if (memcmp(slot_size, "\0\0\0\0\0\0\0\0", 8) == 0) {
+			slot_size[0] = 1;
+		}
+	}
+	qop_close(&qop);
+
+	error_if(!qop_open_memory(data, size, &qop), "Could not open the corrupted full.qop");
+	void *index = malloc(qop.hashmap_size);
+	error_if(!qop_read_index(&qop, index), "Could not read the index of the corrupted full.qop");
+	error_if(qop_find(&qop, "not/in/the/archive") != NULL, "Found a file that is not in the archive");
+	error_if(qop_find(&qop, files[3].path) == NULL, "File %s not found", files[3].path);
+	qop_close(&qop);
+	free(index);
+	free(data);
+	free_files(files, 8);
+	passed("full_hashmap");
+}
+
+
+// -----------------------------------------------------------------------------
+// Streams of compressed files: a file larger than the stream buffers, stored as
+// a single zstd frame and as chunks, is read in uneven pieces with skips
+
+static void test_stream_compressed(void) {
+	#ifdef QOP_ZSTD
+		unsigned int size = QOP_STREAM_BUFFER_SIZE * 3 + 1234;
+		unsigned char *data = malloc(size);
+		qop_uint64_t seed = 3;
+		for (unsigned int i = 0; i < size; i++) {
+			// Compressible, but not trivially
+			data[i] = (i / 7) % 251 ^ (rng(&seed) % 4);
+		}
+		write_file(TEST_ROOT "/stream/large.bin", data, size);
+
+		const char *flags[] = {"--zstd 3 --chunk 1073741824", "--zstd 3 --chunk 300000"};
+		open_func opens[] = {qop_open, qop_open_mmap};
+		unsigned char *buffer = malloc(size);
+		for (int f = 0; f < 2; f++) {
+			char args[MAX_PATH_LEN];
+			snprintf(args, sizeof(args), "%s " TEST_ROOT "/stream stream.qop", flags[f]);
+			error_if(qopconv(args) != 0, "Could not pack with %s", args);
+
+			for (int o = 0; o < 2; o++) {
+				qop_desc qop;
+				void *index, *paths;
+				open_archive(opens[o], "stream.qop", &qop, &index, &paths);
+				qop_file *file = qop_find(&qop, TEST_ROOT "/stream/large.bin");
+				error_if(!file || !(file->flags & QOP_FLAG_COMPRESSED_ZSTD), "Compressed file not found");
+				error_if(!!(file->flags & QOP_FLAG_ZSTD_CHUNKED) != f, "Unexpected chunking with %s", flags[f]);
+
+				qop_stream stream;
+				error_if(!qop_stream_open(&qop, file, &stream), "Could not open stream");
+				qop_uint64_t pos = 0;
+				for (int i = 0; pos < size; i++) {
+					unsigned int len = 1 + rng(&seed) % (QOP_STREAM_BUFFER_SIZE / 2);
+					if (i % 5 == 4) {
+						pos += qop_stream_skip(&stream, len);
+						continue;
+					}
+					qop_uint64_t bytes_read = qop_stream_read(&stream, buffer, len);
+					error_if(
+						bytes_read != (len < size - pos ? len : size - pos) ||
+						memcmp(buffer, data + pos, bytes_read) != 0,
+						"Wrong stream data at %llu with %s", pos, flags[f]
+					);
+					pos += bytes_read;
+				}
+				error_if(qop_stream_tell(&stream) != size || qop_stream_read(&stream, buffer, 1) != 0, "Stream did not end");
+				qop_stream_close(&stream);
+
+				qop_close(&qop);
+				free(index);
+				free(paths);
+			}
+		}
+		free(buffer);
+		free(data);
+		passed("stream_compressed");
+	#else
+		printf("skip\tstream_compressed (build with ZSTD=1)\n");
+	#endif
+}
+
+
+// -----------------------------------------------------------------------------
+// Compacting shared data: with --dedup, files that share data point into the
+// data of the first one. After that owner is replaced with -a, -c must still be
+// able to address the shared data from files with longer paths. An empty file
+// must survive both.
+
+static void test_compact_shared(void) {
+	const char *owner = "compact_owner_aaaaaaaaaaaaaaaa";
+	const char *empty = "s/empty.txt";
+	const char *shared[] = {"s/b", "s/cccccccccccc"};
+	const char *contents = "the same contents in all three files";
+	const char *replaced = "new contents of the owner";
+
+	write_file(owner, contents, strlen(contents));
+	for (int i = 0; i < 2; i++) {
+		write_file(shared[i], contents, strlen(contents));
+	}
+	write_file(empty, "", 0);
+	char args[MAX_PATH_LEN];
+	snprintf(args, sizeof(args), "--dedup %s %s %s %s compact.qop", owner, shared[0], shared[1], empty);
+	error_if(qopconv(args) != 0, "Could not pack with %s", args);
+
+	write_file(owner, replaced, strlen(replaced));
+	snprintf(args, sizeof(args), "-a compact.qop %s", owner);
+	error_if(qopconv(args) != 0, "Could not replace the owner with %s", args);
+	error_if(qopconv("-c compact.qop") != 0, "Could not compact");
+
+	qop_desc qop;
+	void *index, *paths;
+	open_archive(qop_open, "compact.qop", &qop, &index, &paths);
+	error_if(qop.index_len != 4 || !index_has_path(&qop, empty), "Empty file %s lost by -a or -c", empty);
+	unsigned char buffer[256];
+	for (int i = 0; i < 2; i++) {
+		qop_file *file = qop_find(&qop, shared[i]);
+		error_if(
+			!file ||
+			qop_read(&qop, file, buffer) != strlen(contents) ||
+			memcmp(buffer, contents, strlen(contents)) != 0,
+			"Wrong contents of %s after compacting", shared[i]
+		);
+	}
+	qop_close(&qop);
+	free(index);
+	free(paths);
+
+	char path[MAX_PATH_LEN];
+	base_path(path, "unpacked");
+	mkdir(path, 0755);
+	error_if(qopconv_in("unpacked", "-u ../compact.qop") != 0, "Could not unpack the compacted archive");
+	snprintf(path, sizeof(path), "unpacked/%s", owner);
+	error_if(!file_equals(path, replaced, strlen(replaced)), "Wrong contents of %s after unpacking", owner);
+	for (int i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "unpacked/%s", shared[i]);
+		error_if(!file_equals(path, contents, strlen(contents)), "Wrong contents of %s after unpacking", shared[i]);
+	}
+	passed("compact_shared");
+}
+
+
+// -----------------------------------------------------------------------------
+// Alignment: -a and -c must keep the --align of the archive, so that the data
+// of all files, old and new, stays aligned
+
+static void check_aligned(const char *archive, unsigned int align, int len) {
+	qop_desc qop;
+	void *index, *paths;
+	open_archive(qop_open, archive, &qop, &index, &paths);
+	error_if((int)qop.index_len != len, "Expected %d files in %s, got %u", len, archive, qop.index_len);
+	for (unsigned int i = 0; i < qop.hashmap_len; i++) {
+		qop_file *file = &qop.hashmap[i];
+		error_if(
+			file->size && (file->offset + file->path_len) % align != 0,
+			"Data of file %016llx in %s not aligned to %u", file->hash, archive, align
+		);
+	}
+	qop_close(&qop);
+	free(index);
+	free(paths);
+}
+
+static void test_align(void) {
+	test_file *files = make_files(TEST_ROOT "/align", 16, 8192, 5);
+	test_file *added = make_files(TEST_ROOT "/align_added", 8, 8192, 6);
+	error_if(
+		qopconv("--align 4096 " TEST_ROOT "/align align.qop") != 0,
+		"Could not pack the align test files"
+	);
+	error_if(
+		qopconv("-a align.qop --align 512 " TEST_ROOT "/align_added") == 0,
+		"Appended with a different alignment than the archive"
+	);
+	error_if(
+		qopconv("-a align.qop " TEST_ROOT "/align_added") != 0,
+		"Could not append to an aligned archive"
+	);
+	check_aligned("align.qop", 4096, 24);
+	error_if(qopconv("-c align.qop") != 0, "Could not compact an aligned archive");
+	check_aligned("align.qop", 4096, 24);
+	error_if(qopconv("-c align.qop --align 512") != 0, "Could not realign an archive");
+	check_aligned("align.qop", 512, 24);
+	error_if(
+		qopconv("-a align.qop --align 512 " TEST_ROOT "/align_added") != 0,
+		"Could not append with the new alignment"
+	);
+	check_aligned("align.qop", 512, 24);
+	free_files(files, 16);
+	free_files(added, 8);
+	passed("align");
+}
+
+
+// -----------------------------------------------------------------------------
+// Verify: --verify opens the archive mapped, where a stored hashmap is used in
+// place, and must report corrupted files
+
+// Flip a byte in the middle of the data of a file in an archive
+static void corrupt_file(const char *archive, const char *file_path) {
+	qop_desc qop;
+	void *index, *paths;
+	open_archive(qop_open, archive, &qop, &index, &paths);
+	qop_file *file = qop_find(&qop, file_path);
+	error_if(!file, "File %s not found", file_path);
+	qop_uint64_t offset = qop.files_offset + file->offset + file->path_len + file->size / 2;
+	qop_close(&qop);
+	free(index);
+	free(paths);
+
+	char path[MAX_PATH_LEN];
+	base_path(path, archive);
+	int fd = open(path, O_RDWR);
+	unsigned char c;
+	error_if(fd < 0 || pread(fd, &c, 1, offset) != 1, "Could not read %s", path);
+	c ^= 0xff;
+	error_if(pwrite(fd, &c, 1, offset) != 1, "Could not write %s", path);
+	close(fd);
+}
+
+static void test_verify(void) {
+	test_file *files = make_files(TEST_ROOT "/verify", 32, 8192, 4);
+	error_if(
+		qopconv("--hashmap --checksums " TEST_ROOT "/verify verify.qop") != 0,
+		"Could not pack the verify test files"
+	);
+	error_if(qopconv("--verify verify.qop") != 0, "Could not verify an archive with a stored hashmap");
+
+	corrupt_file("verify.qop", files[7].path);
+	error_if(qopconv("--verify verify.qop") != 1, "Corrupted file not reported by --verify");
+
+	free_files(files, 32);
+	passed("verify");
+}
+
+// With --dedup, only the first file owns the data; the others are marked as
+// shared. After the owner is replaced with -a, the shared data must still be
+// verified.
+static void test_verify_shared(void) {
+	const char *owner = "verify_owner.txt";
+	const char *shared[] = {"verify_shared/a", "verify_shared/b"};
+	const char *contents = "contents shared by all three files, then only by two";
+	const char *replaced = "new contents of the owner";
+
+	write_file(owner, contents, strlen(contents));
+	for (int i = 0; i < 2; i++) {
+		write_file(shared[i], contents, strlen(contents));
+	}
+	char args[MAX_PATH_LEN];
+	snprintf(args, sizeof(args), "--dedup --checksums %s %s %s verify_shared.qop", owner, shared[0], shared[1]);
+	error_if(qopconv(args) != 0, "Could not pack with %s", args);
+
+	write_file(owner, replaced, strlen(replaced));
+	snprintf(args, sizeof(args), "-a verify_shared.qop %s", owner);
+	error_if(qopconv(args) != 0, "Could not replace the owner with %s", args);
+	error_if(qopconv("--verify verify_shared.qop") != 0, "Could not verify after replacing the owner");
+
+	corrupt_file("verify_shared.qop", shared[0]);
+	error_if(qopconv("--verify verify_shared.qop") != 1, "Corrupted shared data not reported by --verify");
+	passed("verify_shared");
+}
+
+
+// -----------------------------------------------------------------------------
+// Large archives: a sparse file larger than 8 GB is packed and read back past 
+// the 32 bit limits, together with a small file stored after it
+
+typedef struct {
+	qop_uint64_t offset;
+	char marker[16];
+} large_marker;
+
+static void test_large_archive(void) {
+	if (options.skip_large) {
+		printf("skip\tlarge_archive\n");
+		return;
+	}
+
+	large_marker markers[] = {
+		{0, "start"},
+		{(1ull << 32) - 3, "across 4 GB"},
+		{(1ull << 33) + 7, "past 8 GB"},
+		{LARGE_SIZE - 4, "end"}
+	};
+	int markers_len = sizeof(markers) / sizeof(markers[0]);
+
+	char path[MAX_PATH_LEN];
+	base_path(path, TEST_ROOT "/large/big.bin");
+	create_parent_dirs(path);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	error_if(fd < 0, "Could not create %s", path);
+	error_if(ftruncate(fd, LARGE_SIZE) != 0, "Could not resize %s", path);
+	for (int i = 0; i < markers_len; i++) {
+		qop_uint64_t len = strlen(markers[i].marker);
+		if (markers[i].offset + len > LARGE_SIZE) {
+			len = LARGE_SIZE - markers[i].offset;
+		}
+		error_if(
+			pwrite(fd, markers[i].marker, len, markers[i].offset) != (ssize_t)len,
+			"Could not write %s", path
+		);
+	}
+	close(fd);
+
+	const char *small = "stored after the large file";
+	write_file(TEST_ROOT "/large/small.txt", small, strlen(small));
+	error_if(
+		qopconv("--hashmap " TEST_ROOT "/large/big.bin " TEST_ROOT "/large/small.txt large.qop") != 0,
+		"Could not pack the large archive"
+	);
+
+	open_func opens[] = {qop_open, qop_open_mmap};
+	for (int o = 0; o < 2; o++) {
+		qop_desc qop;
+		void *index, *paths;
+		open_archive(opens[o], "large.qop", &qop, &index, &paths);
+		error_if(qop.version != 2, "Large archive is not version 2");
+
+		qop_file *big = qop_find(&qop, TEST_ROOT "/large/big.bin");
+		error_if(!big || big->size != LARGE_SIZE, "Large file not found or wrong size");
+		unsigned char buffer[64];
+		for (int i = 0; i < markers_len; i++) {
+			qop_uint64_t len = strlen(markers[i].marker);
+			if (markers[i].offset + len > LARGE_SIZE) {
+				len = LARGE_SIZE - markers[i].offset;
+			}
+			error_if(
+				qop_read_ex(&qop, big, buffer, markers[i].offset, len) != len ||
+				memcmp(buffer, markers[i].marker, len) != 0,
+				"Wrong data at offset %llu", markers[i].offset
+			);
+		}
+		error_if(
+			qop_read_ex(&qop, big, buffer, (1ull << 32) + 1024, 16) != 16 ||
+			memcmp(buffer, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) != 0,
+			"Wrong data in the sparse part of the large file"
+		);
+
+		qop_file *file = qop_find(&qop, TEST_ROOT "/large/small.txt");
+		error_if(!file || file->offset < LARGE_SIZE, "Small file not found after the large file");
+		error_if(
+			qop_read(&qop, file, buffer) != strlen(small) ||
+			memcmp(buffer, small, strlen(small)) != 0,
+			"Wrong data in the file after the large file"
+		);
+
+		qop_close(&qop);
+		free(index);
+		free(paths);
+	}
+
+	// Don't keep 8 GB around for the remaining tests
+	base_path(path, "large.qop");
+	unlink(path);
+	base_path(path, TEST_ROOT "/large/big.bin");
+	unlink(path);
+	passed("large_archive");
+}
+
+
+// -----------------------------------------------------------------------------
+// Main
+
+static void exit_usage(void) {
+	puts(
+		"Usage: qoptest [OPTION...]\n"
+		"\n"
+		"Options:\n"
+		"  -q <qopconv> ...... qopconv executable (default ./qopconv)\n"
+		"  -w <dir> .......... directory for the generated files (default /tmp)\n"
+		"  -s ................ skip the test with an archive larger than 8 GB\n"
+	);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	options = (test_options){
+		.qopconv = "./qopconv",
+		.work_dir = "/tmp"
+	};
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			options.qopconv = argv[++i];
+		}
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			options.work_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			options.skip_large = 1;
+		}
+		else {
+			exit_usage();
+		}
+	}
+
+	snprintf(base_dir, sizeof(base_dir), "%s/qoptest-XXXXXX", options.work_dir);
+	error_if(!mkdtemp(base_dir), "Could not create a directory in %s", options.work_dir);
+
+	// qopconv is run from the base dir
+	static char qopconv_path[MAX_PATH_LEN];
+	error_if(!realpath(options.qopconv, qopconv_path), "Could not find %s", options.qopconv);
+	options.qopconv = qopconv_path;
+
+	test_concurrent_reads();
+	test_read_ranges();
+	test_read_batch();
+	test_full_hashmap();
+	test_stream_compressed();
+	test_compact_shared();
+	test_align();
+	test_verify();
+	test_verify_shared();
+	test_large_archive();
+
+	char cmd[MAX_PATH_LEN * 2];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", base_dir);
+	run(cmd);
+	return 0;
+}